@@ -19,6 +19,11 @@
 #define TEST_MODE false
 
 #define R8_OPTS_ENABLED true
+/* default of Machine::setMapCache(), pre-rendered map regions pay off when a large static map is drawn every frame,
+   while palette changes render whole regions again so carts animating their palette are slower with it */
+#define R8_MAP_CACHE_ENABLED false
+/* default of Machine::setDrawThreads(), threads rasterizing draw commands recorded during a frame, with 1 everything is drawn immediately */
+#define R8_DRAW_THREADS 1
 #define R8_USE_LODE_PNG true
 
 #if PLATFORM != PLATFORM_LIBRETRO
@@ -29,6 +34,7 @@
   #if PLATFORM == PLATFORM_WIN32
     static constexpr int SCREEN_WIDTH = 240;
     static constexpr int SCREEN_HEIGHT = 240;
+    static constexpr int SCREEN_BPP = 32;
 
     #undef MOUSE_ENABLED
     #define MOUSE_ENABLED true
@@ -54,6 +60,7 @@
   #elif PLATFORM == PLATFORM_OPENDINGUX
     static constexpr int SCREEN_WIDTH = 320;
     static constexpr int SCREEN_HEIGHT = 240;
+    static constexpr int SCREEN_BPP = 16;
 
     static constexpr auto KEY_UP = SDLK_UP;
     static constexpr auto KEY_DOWN = SDLK_DOWN;
@@ -76,6 +83,7 @@
   #elif PLATFORM == PLATFORM_FUNKEY
     static constexpr int SCREEN_WIDTH = 240;
     static constexpr int SCREEN_HEIGHT = 240;
+    static constexpr int SCREEN_BPP = 16;
 
     static constexpr auto KEY_UP = SDLK_u;
     static constexpr auto KEY_DOWN = SDLK_d;
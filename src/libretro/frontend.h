@@ -0,0 +1,37 @@
+#pragma once
+
+#include "libretro.h"
+
+#include <cstdint>
+
+namespace retro8
+{
+  namespace retro
+  {
+    /* frame dupes are used only if frontend answers the query and allows them */
+    inline bool queryCanDupe(retro_environment_t environment)
+    {
+      bool canDupe = false;
+      return environment(RETRO_ENVIRONMENT_GET_CAN_DUPE, &canDupe) && canDupe;
+    }
+
+    /* RGB565 is requested only if wanted, XRGB8888 is requested if it's refused, returns whether RGB565 is used */
+    inline bool negotiatePixelFormat(retro_environment_t environment, bool wants565)
+    {
+      retro_pixel_format pixelFormat = RETRO_PIXEL_FORMAT_RGB565;
+
+      if (wants565 && environment(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &pixelFormat))
+        return true;
+
+      pixelFormat = RETRO_PIXEL_FORMAT_XRGB8888;
+      environment(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &pixelFormat);
+      return false;
+    }
+
+    /* data passed to video callback, nullptr makes frontend show previous frame again */
+    inline const void* frameToSend(const void* screen, bool changed, bool canDupe, uint32_t frameCounter)
+    {
+      return changed || !canDupe || frameCounter == 0 ? screen : nullptr;
+    }
+  }
+}
@@ -1,4 +1,5 @@
 #include "libretro.h"
+#include "frontend.h"
 
 #include "common.h"
 #include "vm/gfx.h"
@@ -9,6 +10,7 @@
 #include "vm/input.h"
 
 #include <cstdarg>
+#include <cstdlib>
 #include <cstring>
 
 #define LIBRETRO_LOG(x, ...) env.logger(retro_log_level::RETRO_LOG_INFO, x # __VA_ARGS__)
@@ -24,7 +26,11 @@ r8::Machine machine;
 r8::io::Loader loader;
 
 r8::input::InputManager input;
-r8::gfx::ColorTable colorTable;
+r8::gfx::ColorTable<r8::gfx::XRGB8888> colorTable;
+r8::gfx::ScreenConverter<r8::gfx::XRGB8888> screenConverter;
+r8::gfx::ColorTable<r8::gfx::RGB565> colorTable565;
+r8::gfx::ScreenConverter<r8::gfx::RGB565> screenConverter565;
+/* large enough for any output format */
 pixel_t* screen;
 int16_t* audioBuffer;
 
@@ -39,6 +45,7 @@ static void fallback_log(enum retro_log_level level, const char *fmt, ...)
 
 struct RetroArchEnv
 {
+  retro_environment_t environment;
   retro_video_refresh_t video;
   retro_audio_sample_t audio;
   retro_audio_sample_batch_t audioBatch;
@@ -48,15 +55,12 @@ struct RetroArchEnv
 
   uint32_t frameCounter;
   uint16_t buttonState;
+  bool canDupe = false;
+  bool rgb565 = false;
 };
 
 RetroArchEnv env;
 
-struct ColorMapper
-{
-  r8::gfx::ColorTable::pixel_t operator()(uint8_t r, uint8_t g, uint8_t b) const { return 0xff000000 | (r << 16) | (g << 8) | b; }
-};
-
 //TODO
 uint32_t Platform::getTicks() { return 0; }
 
@@ -75,7 +79,8 @@ extern "C"
     audioBuffer = new int16_t[SAMPLE_RATE * 2];
     env.logger(retro_log_level::RETRO_LOG_INFO, "Initializing audio buffer of %d bytes\n", sizeof(int16_t) * SAMPLE_RATE * 2);
 
-    colorTable.init(ColorMapper());
+    colorTable.init();
+    colorTable565.init();
     machine.font().load();
     machine.code().loadAPI();
     input.setMachine(&machine);
@@ -111,8 +116,17 @@ extern "C"
 
   void retro_set_environment(retro_environment_t e)
   {
-    retro_pixel_format pixelFormat = RETRO_PIXEL_FORMAT_XRGB8888;
-    e(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &pixelFormat);
+    env.environment = e;
+
+    static const retro_variable variables[] = {
+      { "retro8_pixel_format", "Pixel format (restart); xrgb8888|rgb565" },
+      { "retro8_map_cache", "Cache large map regions (restart); disabled|enabled" },
+      { "retro8_draw_threads", "Drawing threads (restart); 1|2|3|4" },
+      { nullptr, nullptr }
+    };
+    e(RETRO_ENVIRONMENT_SET_VARIABLES, const_cast<retro_variable*>(variables));
+
+    env.canDupe = r8::retro::queryCanDupe(e);
 
     retro_log_callback logger;
     if (e(RETRO_ENVIRONMENT_GET_LOG_INTERFACE, &logger))
@@ -143,6 +157,25 @@ extern "C"
     {
       input.reset();
 
+      /* 16 bits output halves framebuffer bandwidth, XRGB8888 is kept if frontend refuses it */
+      retro_variable variable = { "retro8_pixel_format", nullptr };
+      const bool wants565 = env.environment(RETRO_ENVIRONMENT_GET_VARIABLE, &variable) && variable.value && std::strcmp(variable.value, "rgb565") == 0;
+
+      env.rgb565 = r8::retro::negotiatePixelFormat(env.environment, wants565);
+
+      env.logger(RETRO_LOG_INFO, "[Retro8] Using %s pixel format\n", env.rgb565 ? "RGB565" : "XRGB8888");
+
+      /* map cache only pays off for carts drawing large static maps so it's left to the user */
+      variable = { "retro8_map_cache", nullptr };
+      machine.setMapCache(env.environment(RETRO_ENVIRONMENT_GET_VARIABLE, &variable) && variable.value && std::strcmp(variable.value, "enabled") == 0);
+
+      /* with more than one thread draw calls are recorded and rasterized by bands of rows in parallel */
+      variable = { "retro8_draw_threads", nullptr };
+      machine.setDrawThreads(env.environment(RETRO_ENVIRONMENT_GET_VARIABLE, &variable) && variable.value ? std::atoi(variable.value) : R8_DRAW_THREADS);
+
+      screenConverter.invalidate();
+      screenConverter565.invalidate();
+
       const char* bdata = static_cast<const char*>(info->data);
 
       env.logger(RETRO_LOG_INFO, "[Retro8] Loading %s\n", info->path);
@@ -194,6 +227,8 @@ extern "C"
 
   void retro_run()
   {
+    bool changed = false;
+
     /* if code is at 60fps or every 2 frames (30fps) */
     if (machine.code().require60fps() || env.frameCounter % 2 == 0)
     {
@@ -201,27 +236,19 @@ extern "C"
       machine.code().update();
       machine.code().draw();
 
-      /* rasterize screen memory to ARGB framebuffer */
-      auto* data = machine.memory().screenData();
-      auto* screenPalette = machine.memory().paletteAt(retro8::gfx::SCREEN_PALETTE_INDEX);
-
-      auto pointer = screen;
-
-      for (size_t i = 0; i < r8::gfx::BYTES_PER_SCREEN; ++i)
-      {
-        const r8::gfx::color_byte_t* pixels = data + i;
-        const auto rc1 = colorTable.get(screenPalette->get((pixels)->low()));
-        const auto rc2 = colorTable.get(screenPalette->get((pixels)->high()));
-
-        *(pointer) = rc1;
-        *((pointer)+1) = rc2;
-        (pointer) += 2;
-      }
+      /* rasterize rows of screen memory modified since last frame to ARGB framebuffer */
+      const auto rows = env.rgb565
+        ? screenConverter565.convert(machine.memory(), colorTable565, reinterpret_cast<uint16_t*>(screen))
+        : screenConverter.convert(machine.memory(), colorTable, screen);
+      changed = rows.first < rows.second;
 
       input.manageKeyRepeat();
     }
 
-    env.video(screen, r8::gfx::SCREEN_WIDTH, r8::gfx::SCREEN_HEIGHT, r8::gfx::SCREEN_WIDTH * sizeof(pixel_t));
+    const size_t pitch = r8::gfx::SCREEN_WIDTH * (env.rgb565 ? sizeof(uint16_t) : sizeof(pixel_t));
+
+    /* unchanged frames are sent as dupes so that frontend can skip uploading them */
+    env.video(r8::retro::frameToSend(screen, changed, env.canDupe, env.frameCounter), r8::gfx::SCREEN_WIDTH, r8::gfx::SCREEN_HEIGHT, pitch);
     ++env.frameCounter;
 
     machine.sound().renderSounds(audioBuffer, SAMPLES_PER_FRAME);
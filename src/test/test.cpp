@@ -8,9 +8,11 @@
 #include "vm/machine.h"
 #include "io/loader.h"
 #include "lua/lua.hpp"
+#include "libretro/frontend.h"
 
 #include <unordered_set>
 #include <filesystem>
+#include <memory>
 
 using namespace retro8;
 using namespace retro8::gfx;
@@ -18,6 +20,23 @@ using namespace retro8::gfx;
 extern retro8::Machine machine;
 Machine& m = machine;
 
+/* screen must be read again after every run since pokes leave it to be unpacked */
+static std::vector<color_t> screenAfter(const std::string& script)
+{
+  m.code().initFromSource(script);
+  const color_t* pixels = m.memory().screenPixels();
+  return std::vector<color_t>(pixels, pixels + gfx::SCREEN_WIDTH * gfx::SCREEN_HEIGHT);
+}
+
+static lua_Number evaluate(const std::string& expression)
+{
+  m.code().initFromSource("function _test() return " + expression + " end");
+  m.code().callFunction("_test", 1);
+  const lua_Number value = lua_tonumber(m.code().state(), -1);
+  lua_pop(m.code().state(), 1);
+  return value;
+}
+
 TEST_CASE("cursor([x,] [y,] [col])")
 {
   Machine& m = machine;
@@ -63,6 +82,186 @@ TEST_CASE("camera([x,] [y])")
   }
 }
 
+TEST_CASE("fillp([p])")
+{
+  auto* pattern = m.memory().fillPattern();
+
+  SECTION("pattern and transparency are stored in draw state")
+  {
+    m.code().initFromSource("fillp(0x5a5a.8)");
+    REQUIRE(pattern->pattern() == 0x5a5a);
+    REQUIRE(pattern->transparent());
+  }
+
+  SECTION("pattern is reset by fillp() function")
+  {
+    m.code().initFromSource("fillp(0x5a5a)");
+    REQUIRE((pattern->pattern() == 0x5a5a && !pattern->transparent()));
+    m.code().initFromSource("fillp()");
+    REQUIRE((pattern->pattern() == 0 && !pattern->transparent()));
+  }
+}
+
+TEST_CASE("clip([x,] [y,] [w,] [h])")
+{
+  SECTION("clip rect poked outside of screen is restricted to it")
+  {
+    m.code().initFromSource("camera() fillp() clip() pal() cls() poke(0x5f22,200) poke(0x5f23,200) rectfill(0,120,199,199,7) circfill(127,127,90,8)");
+    const color_t* pixels = m.memory().screenPixels();
+    REQUIRE(pixels[gfx::SCREEN_WIDTH * gfx::SCREEN_HEIGHT - 1] == 8);
+    REQUIRE(pixels[119 * gfx::SCREEN_WIDTH] == 0);
+    REQUIRE(m.memory().isRowDirty(gfx::SCREEN_HEIGHT - 1));
+    m.code().initFromSource("clip()");
+  }
+
+  SECTION("clip rect excludes its right and bottom edges")
+  {
+    const auto pixels = screenAfter("camera() fillp() clip() pal() cls() clip(2,2,3,3) rectfill(0,0,127,127,7) clip()");
+    REQUIRE(std::count(pixels.begin(), pixels.end(), color_t(7)) == 9);
+    REQUIRE((pixels[2 * gfx::SCREEN_WIDTH + 2] == 7 && pixels[4 * gfx::SCREEN_WIDTH + 4] == 7));
+    REQUIRE((pixels[4 * gfx::SCREEN_WIDTH + 5] == 0 && pixels[5 * gfx::SCREEN_WIDTH + 4] == 0));
+  }
+}
+
+TEST_CASE("draw state")
+{
+  SECTION("poked draw palette, camera and clip rect are used by following primitives")
+  {
+    auto pixels = screenAfter("camera() fillp() clip() pal() cls() pset(0,0,1) poke(0x5f01,8) pset(1,0,1) pal()");
+    REQUIRE((pixels[0] == 1 && pixels[1] == 8));
+
+    pixels = screenAfter("cls() pset(10,1,7) poke2(0x5f28,10) pset(10,1,9) camera()");
+    REQUIRE((pixels[gfx::SCREEN_WIDTH + 10] == 7 && pixels[gfx::SCREEN_WIDTH] == 9));
+
+    pixels = screenAfter("cls() rectfill(0,0,0,0,6) poke(0x5f20,2) poke(0x5f21,3) poke(0x5f22,5) poke(0x5f23,6) rectfill(0,0,127,127,7) clip()");
+    REQUIRE(pixels[0] == 6);
+    REQUIRE(std::count(pixels.begin(), pixels.end(), color_t(7)) == 9);
+    REQUIRE((pixels[3 * gfx::SCREEN_WIDTH + 2] == 7 && pixels[5 * gfx::SCREEN_WIDTH + 4] == 7));
+  }
+
+  SECTION("draw state is kept until a draw state address is written")
+  {
+    m.code().initFromSource("camera(1,2) clip(3,4,5,6) pal(2,9)");
+    const uint32_t generation = m.memory().drawStateGeneration();
+
+    m.code().initFromSource("pset(0,0,1) poke(0x4300,1) sset(0,0,1)");
+    REQUIRE(m.memory().drawStateGeneration() == generation);
+
+    m.code().initFromSource("camera() clip() pal()");
+    REQUIRE(m.memory().drawStateGeneration() != generation);
+    m.code().initFromSource("cls() sset(0,0,0)");
+  }
+}
+
+TEST_CASE("rectfill(x0, y0, x1, y1, [col]) and cls([col])")
+{
+  SECTION("corners in any order fill inclusive rect inside clip rect")
+  {
+    const auto pixels = screenAfter("camera() fillp() clip() pal() cls() clip(3,4,2,2) rectfill(5,7,2,3,8) clip() rectfill(10,12,8,10,9)");
+
+    for (coord_t y = 0; y < 16; ++y)
+      for (coord_t x = 0; x < 16; ++x)
+      {
+        CAPTURE(x, y);
+        const color_t expected = (x >= 3 && x <= 4 && y >= 4 && y <= 5) ? color_t(8) : (x >= 8 && x <= 10 && y >= 10 && y <= 12) ? color_t(9) : color_t::BLACK;
+        REQUIRE(pixels[y * gfx::SCREEN_WIDTH + x] == expected);
+      }
+  }
+
+  SECTION("spans with odd edges keep neighbouring nibbles in screen memory")
+  {
+    m.code().initFromSource("camera() fillp() clip() pal() cls(3) rectfill(1,0,4,0,9)");
+    REQUIRE(evaluate("peek(0x6000)") == 0x93);
+    REQUIRE(evaluate("peek(0x6001)") == 0x99);
+    REQUIRE(evaluate("peek(0x6002)") == 0x39);
+  }
+
+  SECTION("cls fills whole screen with color")
+  {
+    const auto pixels = screenAfter("camera() fillp() clip() pal() cls(12)");
+    REQUIRE(std::count(pixels.begin(), pixels.end(), color_t(12)) == gfx::SCREEN_WIDTH * gfx::SCREEN_HEIGHT);
+    m.code().initFromSource("cls()");
+  }
+}
+
+TEST_CASE("print(str, [x,] [y,] [col])")
+{
+  SECTION("repeated strings are rasterized once")
+  {
+    const size_t hits = m.textRuns().hits(), misses = m.textRuns().misses();
+    m.code().initFromSource("print(\"cached\",0,0,7) print(\"cached\",10,10,8)");
+    REQUIRE(m.textRuns().misses() == misses + 1);
+    REQUIRE(m.textRuns().hits() == hits + 1);
+  }
+
+  SECTION("text mask lights glyph pixels inside clip rect across its words")
+  {
+    m.font().load();
+    const std::string text = "hello      world 0123456789";
+    m.code().initFromSource("camera() fillp() clip() pal() cls() clip(5,0,100,5) print(\"" + text + "\",-3,2,7) clip()");
+    const color_t* pixels = m.memory().screenPixels();
+
+    std::vector<color_t> expected(gfx::SCREEN_WIDTH * gfx::SCREEN_HEIGHT, color_t::BLACK);
+    for (size_t i = 0; i < text.length(); ++i)
+      for (coord_t ty = 0; ty < gfx::GLYPH_HEIGHT; ++ty)
+        for (coord_t tx = 0; tx < gfx::GLYPH_WIDTH; ++tx)
+        {
+          const coord_t x = -3 + coord_t(i) * gfx::GLYPH_WIDTH + tx, y = 2 + ty;
+          if (x >= 5 && x < 105 && y < 5 && (m.font().glyph(text[i])[ty] & (1 << tx)))
+            expected[y * gfx::SCREEN_WIDTH + x] = color_t(7);
+        }
+
+    REQUIRE(std::equal(expected.begin(), expected.end(), pixels));
+  }
+
+  SECTION("special glyphs are decoded from their longest encoding")
+  {
+    const Font& font = m.font();
+    size_t length = 0;
+
+    REQUIRE(font.decode("a", 1, length) == 'a');
+    REQUIRE(length == 1);
+    REQUIRE(font.decode("\xe2\xac\x87\xef\xb8\x8fz", 7, length) == Font::SPECIAL_GLYPHS_BASE + 3);
+    REQUIRE(length == 6);
+    REQUIRE(font.decode("\xe2\x9d\x8e", 3, length) == Font::SPECIAL_GLYPHS_BASE + 23);
+    REQUIRE(length == 3);
+    REQUIRE(font.decode("\x8b", 1, length) == Font::SPECIAL_GLYPHS_BASE + 11);
+    REQUIRE(length == 1);
+
+    /* truncated encodings are a single invalid byte */
+    REQUIRE(font.decode("\xe2\xac\x87", 3, length) == Font::INVALID_GLYPH);
+    REQUIRE(length == 1);
+  }
+
+  SECTION("special glyphs are sprite wide")
+  {
+    m.font().load();
+    const auto special = screenAfter("camera() fillp() clip() pal() cls() print(\"\x8b\",0,0,7)");
+    const auto expected = screenAfter("cls() print(\"\x8b\",0,0,7) print(\"a\",8,0,7)");
+    REQUIRE(std::count(special.begin(), special.end(), color_t(7)) > 0);
+    REQUIRE(expected == screenAfter("cls() print(\"\x8b" "a\",0,0,7)"));
+    m.code().initFromSource("cls()");
+  }
+
+  SECTION("loading font discards rasterized text")
+  {
+    m.font().load();
+    m.code().initFromSource("camera() fillp() clip() pal() cls() print(\"a\",0,0,7)");
+    const size_t misses = m.textRuns().misses();
+
+    std::vector<uint8_t> lit(gfx::SPRITE_WIDTH * gfx::FONT_GLYPHS_COLUMNS * gfx::SPRITE_HEIGHT * gfx::FONT_GLYPHS_ROWS, 1);
+    m.font().load(lit.data());
+    m.code().initFromSource("cls() print(\"a\",0,0,7)");
+    const color_t* pixels = m.memory().screenPixels();
+    m.font().load();
+
+    REQUIRE(m.textRuns().misses() == misses + 1);
+    for (coord_t y = 0; y < 8; ++y)
+      for (coord_t x = 0; x < 8; ++x)
+        REQUIRE(pixels[y * gfx::SCREEN_WIDTH + x] == color_t(x < gfx::GLYPH_WIDTH && y < gfx::GLYPH_HEIGHT ? 7 : 0));
+  }
+}
+
 TEST_CASE("tilemap")
 {
   Machine m;
@@ -91,6 +290,793 @@ TEST_CASE("tilemap")
   }
 }
 
+TEST_CASE("psetbatch(t)")
+{
+  SECTION("every complete triple of table is drawn")
+  {
+    m.code().initFromSource("camera() fillp() cls() psetbatch({ 0,0,7, 5,1,8, 9 })");
+    const color_t* pixels = m.memory().screenPixels();
+    REQUIRE((pixels[0] == 7 && pixels[gfx::SCREEN_WIDTH + 5] == 8));
+  }
+
+  SECTION("batch is a single command marking union of its rows")
+  {
+    m.code().initFromSource("camera() fillp() cls()");
+    m.memory().clearDirtyRows();
+    m.code().initFromSource("psetbatch({ 0,10,7, 3,50,8 })");
+    REQUIRE((!m.memory().isRowDirty(9) && m.memory().isRowDirty(10) && m.memory().isRowDirty(30) && m.memory().isRowDirty(50) && !m.memory().isRowDirty(51)));
+  }
+}
+
+TEST_CASE("sprbatch(t)")
+{
+  SECTION("batch draws same pixels as spr calls")
+  {
+    const std::string setup = "camera(3,-2) fillp() clip(4,4,100,90) pal() palt() for i=0,127 do for j=0,31 do sset(i,j,(i*7+j)%16) end end cls() ";
+    const std::string entries[] = { "1,0,0", "5,-4,20", "17,120,80", "33,60,60", "9,61,63" };
+
+    std::string batch = setup + "sprbatch({", calls = setup;
+    for (const auto& entry : entries)
+    {
+      batch += entry + ",";
+      calls += "spr(" + entry + ") ";
+    }
+    batch += "})";
+
+    m.code().initFromSource(calls);
+    const color_t* pixels = m.memory().screenPixels();
+    const std::vector<color_t> expected(pixels, pixels + gfx::SCREEN_WIDTH * gfx::SCREEN_HEIGHT);
+
+    m.code().initFromSource(batch);
+    pixels = m.memory().screenPixels();
+    REQUIRE(std::equal(expected.begin(), expected.end(), pixels));
+    m.code().initFromSource("camera() clip() memset(0,0,0x800)");
+  }
+}
+
+TEST_CASE("spr(n, x, y, [w, h], [flip_x], [flip_y])")
+{
+  SECTION("sprites are moved by camera, clipped and flipped with transparency")
+  {
+    auto texel = [] (coord_t x, coord_t y) { return color_t((x * 5 + y * 3) % 16); };
+    m.code().initFromSource("camera() fillp() clip() pal() palt() for i=8,15 do for j=0,7 do sset(i,j,(i*5+j*3)%16) end end");
+
+    for (int opaque = 0; opaque < 2; ++opaque)
+      for (int flips = 0; flips < 4; ++flips)
+      {
+        const bool flipX = flips & 1, flipY = flips & 2;
+        CAPTURE(opaque, flipX, flipY);
+
+        const auto pixels = screenAfter(std::string("cls(1) palt(0,") + (opaque ? "false" : "true") + ") camera(2,3) clip(4,4,5,5) spr(1,5,6,1,1,"
+          + (flipX ? "true" : "false") + "," + (flipY ? "true" : "false") + ") clip() camera() palt()");
+
+        for (coord_t y = 0; y < 16; ++y)
+          for (coord_t x = 0; x < 16; ++x)
+          {
+            color_t expected = color_t(1);
+            const coord_t u = x - 3, v = y - 3;
+
+            if (x >= 4 && x < 9 && y >= 4 && y < 9)
+            {
+              const color_t c = texel(8 + (flipX ? 7 - u : u), flipY ? 7 - v : v);
+              if (c != color_t::BLACK || opaque)
+                expected = c;
+            }
+
+            CAPTURE(x, y);
+            REQUIRE(pixels[y * gfx::SCREEN_WIDTH + x] == expected);
+          }
+      }
+
+    m.code().initFromSource("cls() memset(0,0,0x800)");
+  }
+}
+
+TEST_CASE("sspr(sx, sy, sw, sh, dx, dy, [dw, dh], [flip_x], [flip_y])")
+{
+  SECTION("1:1 and integer ratios draw every opaque texel as a block inside clip rect")
+  {
+    auto texel = [] (coord_t x, coord_t y) { return color_t((x * 7 + y * 3) % 16); };
+    m.code().initFromSource("camera() fillp() clip() pal() palt() for i=0,127 do for j=0,31 do sset(i,j,(i*7+j*3)%16) end end");
+
+    const coord_t sx = 116, sy = 3, sw = 16, sh = 5, dx = 10, dy = 20, cx = 14, cy = 22, cw = 30, ch = 9;
+
+    for (coord_t kx = 1; kx <= 3; ++kx)
+      for (coord_t ky = 1; ky <= 3; ++ky)
+        for (int flips = 0; flips < 4; ++flips)
+        {
+          const bool flipX = flips & 1, flipY = flips & 2;
+          CAPTURE(kx, ky, flipX, flipY);
+
+          m.code().initFromSource("cls() clip(" + std::to_string(cx) + "," + std::to_string(cy) + "," + std::to_string(cw) + "," + std::to_string(ch) + ") sspr("
+            + std::to_string(sx) + "," + std::to_string(sy) + "," + std::to_string(sw) + "," + std::to_string(sh) + "," + std::to_string(dx) + "," + std::to_string(dy) + ","
+            + std::to_string(sw * kx) + "," + std::to_string(sh * ky) + "," + (flipX ? "true" : "false") + "," + (flipY ? "true" : "false") + ") clip()");
+          const color_t* pixels = m.memory().screenPixels();
+
+          std::vector<color_t> expected(gfx::SCREEN_WIDTH * gfx::SCREEN_HEIGHT, color_t::BLACK);
+          for (coord_t y = cy; y < cy + ch; ++y)
+            for (coord_t x = cx; x < cx + cw; ++x)
+            {
+              const coord_t u = (x - dx) / kx, v = (y - dy) / ky;
+              if (x < dx || y < dy || u >= sw || v >= sh)
+                continue;
+
+              const coord_t tx = sx + (flipX ? sw - u - 1 : u), ty = sy + (flipY ? sh - v - 1 : v);
+              if (tx < 128)
+                expected[y * gfx::SCREEN_WIDTH + x] = texel(tx, ty);
+            }
+
+          REQUIRE(std::equal(expected.begin(), expected.end(), pixels));
+        }
+
+    m.code().initFromSource("memset(0,0,0x800)");
+  }
+}
+
+TEST_CASE("sprite sheet cache")
+{
+  auto sprite = [] (const std::string& script) { return screenAfter("camera() fillp() clip() pal() palt(0,false) cls() " + script + " spr(0,0,0) palt()"); };
+
+  SECTION("opaque bounds follow sprite pixels and transparent colors")
+  {
+    m.code().initFromSource("memset(0,0,0x800) sset(10,3,5) sset(14,1,4)");
+    std::unique_ptr<SpriteSheetCache> cache(new SpriteSheetCache());
+    cache->update(m.memory().spriteSheet(), 1);
+
+    auto bounds = [&cache] (sprite_index_t index, SpriteSheetCache::color_mask_t transparent) {
+      const auto& b = cache->bounds(index, transparent);
+      return std::array<coord_t, 4>{ { b.x0, b.y0, b.x1, b.y1 } };
+    };
+
+    REQUIRE(bounds(1, 0x0001) == (std::array<coord_t, 4>{ { 2, 1, 7, 4 } }));
+    REQUIRE(bounds(1, 0x0011) == (std::array<coord_t, 4>{ { 2, 3, 3, 4 } }));
+    REQUIRE(cache->bounds(1, 0x0031).empty());
+    REQUIRE(cache->bounds(2, 0x0001).empty());
+    REQUIRE(bounds(2, 0x0000) == (std::array<coord_t, 4>{ { 0, 0, 8, 8 } }));
+  }
+
+  SECTION("flipped sprites draw their bounds mirrored inside the cell")
+  {
+    const auto pixels = screenAfter("camera() fillp() clip() pal() palt() cls() memset(0,0,0x800) sset(10,3,5) sset(14,1,4) spr(1,10,10,1,1,true,true)");
+    REQUIRE(pixels[14 * gfx::SCREEN_WIDTH + 15] == 5);
+    REQUIRE(pixels[16 * gfx::SCREEN_WIDTH + 11] == 4);
+    REQUIRE(std::count(pixels.begin(), pixels.end(), color_t::BLACK) == gfx::SCREEN_WIDTH * gfx::SCREEN_HEIGHT - 2);
+  }
+
+  SECTION("changes through sset, poke, memset and memcpy are drawn")
+  {
+    m.code().initFromSource("memset(0,0,0x800)");
+    REQUIRE(sprite("sset(0,0,7)")[0] == 7);
+    REQUIRE(sprite("poke(0,0x98)")[0] == 8);
+    REQUIRE(sprite("")[1] == 9);
+
+    auto pixels = sprite("memset(0,0x55,4)");
+    REQUIRE(std::count(pixels.begin(), pixels.begin() + 8, color_t(5)) == 8);
+
+    pixels = sprite("memcpy(64,0,4)");
+    REQUIRE(std::count(pixels.begin() + gfx::SCREEN_WIDTH, pixels.begin() + gfx::SCREEN_WIDTH + 8, color_t(5)) == 8);
+  }
+
+  SECTION("memset writes its value")
+  {
+    m.code().initFromSource("memset(0x4300,0,8) memset(0x4300,0xab,3)");
+    REQUIRE(evaluate("peek(0x4300)") == 0xab);
+    REQUIRE(evaluate("peek(0x4302)") == 0xab);
+    REQUIRE(evaluate("peek(0x4303)") == 0);
+  }
+
+  SECTION("reload restores sprite sheet from cartridge")
+  {
+    m.code().initFromSource("memset(0,0,0x800) sset(0,0,3)");
+    m.memory().backupCartridge();
+
+    REQUIRE(sprite("sset(0,0,7)")[0] == 7);
+    REQUIRE(sprite("reload()")[0] == 3);
+    REQUIRE(sprite("reload(0x40,0,1)")[gfx::SCREEN_WIDTH] == 3);
+
+    m.code().initFromSource("memset(0,0,0x800)");
+    m.memory().backupCartridge();
+  }
+}
+
+TEST_CASE("shadow framebuffer")
+{
+  auto row = [] (const std::vector<color_t>& pixels, coord_t y) { return pixels.data() + y * gfx::SCREEN_WIDTH; };
+
+  SECTION("drawn pixels are packed when screen memory is read")
+  {
+    m.code().initFromSource("camera() fillp() clip() pal() cls() pset(0,0,1) pset(1,0,2) pset(3,0,15)");
+    REQUIRE(evaluate("peek(0x6000)") == 0x21);
+    REQUIRE(evaluate("peek(0x6001)") == 0xf0);
+  }
+
+  SECTION("poked screen memory is unpacked for drawing and pget")
+  {
+    m.code().initFromSource("cls() poke(0x6040,0x43)");
+    REQUIRE(evaluate("pget(0,1)") == 3);
+    REQUIRE(evaluate("pget(1,1)") == 4);
+
+    const auto pixels = screenAfter("pset(2,1,9)");
+    REQUIRE((row(pixels, 1)[0] == 3 && row(pixels, 1)[1] == 4 && row(pixels, 1)[2] == 9));
+  }
+
+  SECTION("memcpy and memset keep screen memory and pixels coherent")
+  {
+    const auto pixels = screenAfter("cls() rectfill(0,2,127,2,5) memcpy(0x60c0,0x6080,64) memcpy(0x4300,0x6080,4) "
+      "memcpy(0x6100,0x4300,1) pset(1,4,9) memset(0x6140,0x77,2) pset(4,5,8)");
+
+    REQUIRE(std::count(row(pixels, 3), row(pixels, 4), color_t(5)) == gfx::SCREEN_WIDTH);
+    REQUIRE(evaluate("peek(0x4300)") == 0x55);
+    REQUIRE((row(pixels, 4)[0] == 5 && row(pixels, 4)[1] == 9 && row(pixels, 4)[2] == 0));
+    REQUIRE((std::count(row(pixels, 5), row(pixels, 5) + 4, color_t(7)) == 4 && row(pixels, 5)[4] == 8));
+    REQUIRE(evaluate("peek(0x6142)") == 0x08);
+    m.code().initFromSource("cls()");
+  }
+}
+
+TEST_CASE("dirty rows")
+{
+  SECTION("primitives mark only rows they touch")
+  {
+    m.memory().clearDirtyRows();
+    m.code().initFromSource("rectfill(0,10,127,12,7)");
+    REQUIRE((!m.memory().isRowDirty(9) && m.memory().isRowDirty(10) && m.memory().isRowDirty(12) && !m.memory().isRowDirty(13)));
+  }
+
+  SECTION("screen palette change marks every row")
+  {
+    m.memory().clearDirtyRows();
+    m.code().initFromSource("pal(1,2,1)");
+    REQUIRE((m.memory().isRowDirty(0) && m.memory().isRowDirty(gfx::SCREEN_HEIGHT - 1)));
+  }
+}
+
+/* converts screen with every kernel available and counts pixels differing from scalar kernel or screen palette */
+template<typename F>
+static size_t kernelMismatches(Memory& memory)
+{
+  ColorTable<F> table;
+  table.init();
+  ScreenConverter<F> converter;
+  std::vector<typename F::pixel_t> output(gfx::SCREEN_WIDTH * gfx::SCREEN_HEIGHT);
+
+  const color_t* pixels = memory.screenPixels();
+  const palette_t* palette = memory.paletteAt(gfx::SCREEN_PALETTE_INDEX);
+  size_t mismatches = 0;
+
+  for (auto kernel : ScreenConverter<F>::kernels())
+  {
+    std::fill(output.begin(), output.end(), 0);
+    converter.setKernel(kernel);
+    converter.convert(memory, table, output.data());
+
+    for (size_t i = 0; i < output.size(); ++i)
+      mismatches += output[i] != table.get(palette->get(pixels[i]));
+  }
+
+  return mismatches;
+}
+
+TEST_CASE("screen conversion")
+{
+  ColorTable<XRGB8888> table;
+  table.init();
+  std::vector<XRGB8888::pixel_t> output(gfx::SCREEN_WIDTH * gfx::SCREEN_HEIGHT);
+  ScreenConverter<XRGB8888> converter;
+
+  SECTION("screen palette change converts every row again")
+  {
+    m.code().initFromSource("cls(1)");
+    converter.convert(m.memory(), table, output.data());
+    m.code().initFromSource("pal(1,8,1)");
+    const auto rows = converter.convert(m.memory(), table, output.data());
+    REQUIRE((rows.first == 0 && rows.second == gfx::SCREEN_HEIGHT));
+    REQUIRE(output.back() == table.get(color_t(8)));
+    m.code().initFromSource("pal()");
+  }
+
+  SECTION("frame redrawn with same content is unchanged")
+  {
+    m.code().initFromSource("cls(3) rectfill(10,10,20,20,7)");
+    converter.convert(m.memory(), table, output.data());
+    m.code().initFromSource("cls(3) rectfill(10,10,20,20,7)");
+    const auto rows = converter.convert(m.memory(), table, output.data());
+    REQUIRE(rows.first >= rows.second);
+  }
+
+  SECTION("every pixel is converted through color table")
+  {
+    m.code().initFromSource("for i=0x6000,0x7fff do poke(i,(i*37)%256) end");
+    converter.convert(m.memory(), table, output.data());
+    const color_t* pixels = m.memory().screenPixels();
+    size_t mismatches = 0;
+    for (size_t i = 0; i < output.size(); ++i)
+      mismatches += output[i] != table.get(pixels[i]);
+    REQUIRE(mismatches == 0);
+  }
+
+  SECTION("scaled conversion maps every output pixel to nearest source one")
+  {
+    m.code().initFromSource("camera() fillp() cls() pset(1,0,7)");
+    std::vector<XRGB8888::pixel_t> scaled(256 * 256);
+    converter.convertScaled(m.memory(), table, scaled.data(), 256 * sizeof(XRGB8888::pixel_t), scale_map_t::nearest(0, 0, 256, 256, 256, 256));
+    REQUIRE((scaled[1] == table.get(color_t(0)) && scaled[2] == table.get(color_t(7)) && scaled[256 + 3] == table.get(color_t(7))));
+  }
+
+  SECTION("scaled conversion only writes output rows of changed source ones")
+  {
+    const auto map = scale_map_t::nearest(0, 0, 256, 256, 256, 256);
+    std::vector<XRGB8888::pixel_t> scaled(256 * 256);
+    m.code().initFromSource("camera() fillp() cls()");
+    converter.convertScaled(m.memory(), table, scaled.data(), 256 * sizeof(XRGB8888::pixel_t), map);
+
+    const auto unchanged = converter.convertScaled(m.memory(), table, scaled.data(), 256 * sizeof(XRGB8888::pixel_t), map);
+    REQUIRE(unchanged.first >= unchanged.second);
+
+    std::fill(scaled.begin(), scaled.end(), 0);
+    m.code().initFromSource("pset(0,5,7)");
+    const auto rows = converter.convertScaled(m.memory(), table, scaled.data(), 256 * sizeof(XRGB8888::pixel_t), map);
+    REQUIRE((rows.first == 5 && rows.second == 6 && !m.memory().hasDirtyRows()));
+    REQUIRE((scaled[10 * 256] == table.get(color_t(7)) && scaled[11 * 256 + 1] == table.get(color_t(7)) && scaled[12 * 256] == 0));
+  }
+
+  SECTION("changed rows are converted into a destination with pitch")
+  {
+    converter.convert(m.memory(), table, output.data());
+    m.code().initFromSource("camera() fillp() pset(0,10,7) pset(0,12,8)");
+    const auto rows = converter.changedRows(m.memory(), table);
+    REQUIRE((rows.first == 10 && rows.second == 13));
+
+    std::vector<XRGB8888::pixel_t> band(3 * 256);
+    converter.convertRows(m.memory(), rows.first, rows.second, band.data(), 256 * sizeof(XRGB8888::pixel_t));
+    REQUIRE((band[0] == table.get(color_t(7)) && band[2 * 256] == table.get(color_t(8))));
+    REQUIRE(!m.memory().hasDirtyRows());
+  }
+
+  SECTION("16 bits formats are converted through their own color table")
+  {
+    ColorTable<RGB565> table565;
+    table565.init();
+    std::vector<RGB565::pixel_t> output565(gfx::SCREEN_WIDTH * gfx::SCREEN_HEIGHT);
+    ScreenConverter<RGB565> converter565;
+
+    m.code().initFromSource("cls(8)");
+    converter565.convert(m.memory(), table565, output565.data());
+    REQUIRE(output565.back() == 0xf809);
+
+    ColorTable<BGR565> tableBGR565;
+    tableBGR565.init();
+    ScreenConverter<BGR565> converterBGR565;
+
+    converterBGR565.convert(m.memory(), tableBGR565, output565.data());
+    REQUIRE(output565.back() == 0x481f);
+  }
+
+  SECTION("display formats are written in their layout or reported unsupported")
+  {
+    REQUIRE(outputFormatFor(4, 0x00ff0000, 0x0000ff00, 0x000000ff) == OutputFormat::XRGB8888);
+    REQUIRE(outputFormatFor(4, 0x000000ff, 0x0000ff00, 0x00ff0000) == OutputFormat::XRGB8888);
+    REQUIRE(outputFormatFor(2, 0xf800, 0x07e0, 0x001f) == OutputFormat::RGB565);
+    REQUIRE(outputFormatFor(2, 0x001f, 0x07e0, 0xf800) == OutputFormat::BGR565);
+    REQUIRE(outputFormatFor(2, 0x7c00, 0x03e0, 0x001f) == OutputFormat::RGB565);
+    REQUIRE(outputFormatFor(3, 0xff0000, 0x00ff00, 0x0000ff) == OutputFormat::UNSUPPORTED);
+    REQUIRE(outputFormatFor(1, 0, 0, 0) == OutputFormat::UNSUPPORTED);
+    REQUIRE(outputFormatFor(0, 0, 0, 0) == OutputFormat::UNSUPPORTED);
+  }
+
+  SECTION("every kernel converts same pixels as scalar one")
+  {
+    /* diagonal pattern through a shuffled screen palette catches lane order and permutation mistakes */
+    m.code().initFromSource("camera() fillp() clip() pal() for y=0,127 do for x=0,127 do pset(x,y,(x+y)%16) end end for i=0,15 do pal(i,(i*7+3)%16,1) end");
+    CAPTURE(ScreenConverter<XRGB8888>::kernels().size());
+    REQUIRE(kernelMismatches<XRGB8888>(m.memory()) == 0);
+    REQUIRE(kernelMismatches<RGB565>(m.memory()) == 0);
+    REQUIRE(kernelMismatches<BGR565>(m.memory()) == 0);
+    m.code().initFromSource("pal()");
+  }
+}
+
+/* libretro frontend which answers queries as configured and records requested pixel formats */
+static struct
+{
+  bool acceptsQueries, canDupe, accepts565;
+  std::vector<retro_pixel_format> requested;
+} frontend;
+
+static bool frontendEnvironment(unsigned command, void* data)
+{
+  if (command == RETRO_ENVIRONMENT_GET_CAN_DUPE)
+  {
+    *static_cast<bool*>(data) = frontend.canDupe;
+    return frontend.acceptsQueries;
+  }
+  else if (command == RETRO_ENVIRONMENT_SET_PIXEL_FORMAT)
+  {
+    const retro_pixel_format format = *static_cast<retro_pixel_format*>(data);
+    frontend.requested.push_back(format);
+    return format != RETRO_PIXEL_FORMAT_RGB565 || frontend.accepts565;
+  }
+
+  return false;
+}
+
+TEST_CASE("libretro frontend negotiation")
+{
+  SECTION("refused RGB565 falls back to XRGB8888")
+  {
+    frontend = { true, true, false, { } };
+    REQUIRE(!retro::negotiatePixelFormat(frontendEnvironment, true));
+    REQUIRE(frontend.requested == (std::vector<retro_pixel_format>{ RETRO_PIXEL_FORMAT_RGB565, RETRO_PIXEL_FORMAT_XRGB8888 }));
+
+    frontend = { true, true, true, { } };
+    REQUIRE(retro::negotiatePixelFormat(frontendEnvironment, true));
+    REQUIRE(frontend.requested == (std::vector<retro_pixel_format>{ RETRO_PIXEL_FORMAT_RGB565 }));
+
+    frontend = { true, true, true, { } };
+    REQUIRE(!retro::negotiatePixelFormat(frontendEnvironment, false));
+    REQUIRE(frontend.requested == (std::vector<retro_pixel_format>{ RETRO_PIXEL_FORMAT_XRGB8888 }));
+  }
+
+  SECTION("unchanged frames are sent again when dupes can't be used")
+  {
+    const uint32_t screen[1] = { 0 };
+
+    frontend = { false, true, true, { } };
+    REQUIRE(!retro::queryCanDupe(frontendEnvironment));
+    frontend = { true, false, true, { } };
+    REQUIRE(!retro::queryCanDupe(frontendEnvironment));
+    frontend = { true, true, true, { } };
+    REQUIRE(retro::queryCanDupe(frontendEnvironment));
+
+    REQUIRE(retro::frameToSend(screen, false, false, 5) == screen);
+    REQUIRE(retro::frameToSend(screen, false, true, 0) == screen);
+    REQUIRE(retro::frameToSend(screen, true, true, 5) == screen);
+    REQUIRE(retro::frameToSend(screen, false, true, 5) == nullptr);
+  }
+}
+
+TEST_CASE("tline(x0, y0, x1, y1, mx, my, [mdx, mdy], [layers])")
+{
+  SECTION("map is sampled every 1/8 of tile by default")
+  {
+    m.code().initFromSource("camera() fillp() cls() sset(8,0,7) sset(9,0,9) mset(0,0,1) tline(0,0,2,0,0,0)");
+    const color_t* pixels = m.memory().screenPixels();
+    REQUIRE((pixels[0] == 7 && pixels[1] == 9 && pixels[2] == 0));
+  }
+
+  SECTION("map coordinates wrap with mask registers")
+  {
+    m.code().initFromSource("camera() fillp() cls() sset(8,0,7) mset(0,0,1) mset(2,0,0) poke(0x5f38,2) tline(0,0,16,0,0,0,1,0) poke(0x5f38,0)");
+    const color_t* pixels = m.memory().screenPixels();
+    REQUIRE((pixels[0] == 7 && pixels[2] == 7 && pixels[16] == 7));
+  }
+
+  SECTION("lines clipped up front draw same pixels as unclipped ones inside clip rect")
+  {
+    uint32_t state = 7;
+    auto next = [&state] (int lo, int hi) { state = state * 1103515245 + 12345; return lo + int((state >> 16) % uint32_t(hi - lo + 1)); };
+
+    m.code().initFromSource("camera() fillp() clip() pal() palt() for i=0,127 do for j=0,15 do sset(i,j,1+(i+j*3)%15) end end "
+      "for y=0,15 do for x=0,15 do mset(x,y,(x+y)%32) end end");
+
+    for (int i = 0; i < 200; ++i)
+    {
+      std::string line = "tline(";
+      for (int k = 0; k < 4; ++k)
+        line += std::to_string(next(0, 127)) + ",";
+      line += std::to_string(next(0, 8)) + "," + std::to_string(next(0, 8)) + ",0.1,0.07)";
+
+      const coord_t cx = next(0, 100), cy = next(0, 100), cw = next(1, 60), ch = next(1, 60);
+      CAPTURE(line, cx, cy, cw, ch);
+
+      m.code().initFromSource("clip() cls() " + line);
+      const color_t* pixels = m.memory().screenPixels();
+      std::vector<color_t> expected(gfx::SCREEN_WIDTH * gfx::SCREEN_HEIGHT, color_t::BLACK);
+      for (coord_t y = cy; y < std::min(cy + ch, coord_t(gfx::SCREEN_HEIGHT)); ++y)
+        for (coord_t x = cx; x < std::min(cx + cw, coord_t(gfx::SCREEN_WIDTH)); ++x)
+          expected[y * gfx::SCREEN_WIDTH + x] = pixels[y * gfx::SCREEN_WIDTH + x];
+
+      m.code().initFromSource("cls() clip(" + std::to_string(cx) + "," + std::to_string(cy) + "," + std::to_string(cw) + "," + std::to_string(ch) + ") " + line + " clip()");
+      pixels = m.memory().screenPixels();
+      REQUIRE(std::equal(expected.begin(), expected.end(), pixels));
+    }
+  }
+}
+
+TEST_CASE("line(x0, y0, x1, y1, [col])")
+{
+  SECTION("lines clipped against screen and clip rect draw same pixels as unclipped ones")
+  {
+    uint32_t state = 11;
+    auto next = [&state] (int lo, int hi) { state = state * 1103515245 + 12345; return lo + int((state >> 16) % uint32_t(hi - lo + 1)); };
+
+    for (int i = 0; i < 300; ++i)
+    {
+      const coord_t x0 = next(-80, 200), y0 = next(-80, 200);
+      const coord_t x1 = i % 5 == 0 ? x0 : x0 + next(-120, 120), y1 = i % 5 == 1 ? y0 : y0 + next(-120, 120);
+      const coord_t cx = next(0, 100), cy = next(0, 100), cw = next(1, 80), ch = next(1, 80);
+      const coord_t tx = -std::min(x0, x1), ty = -std::min(y0, y1);
+
+      auto coords = [] (coord_t a, coord_t b, coord_t c, coord_t d) { return std::to_string(a) + "," + std::to_string(b) + "," + std::to_string(c) + "," + std::to_string(d); };
+      CAPTURE(x0, y0, x1, y1, cx, cy, cw, ch);
+
+      const auto reference = screenAfter("camera() fillp() clip() pal() cls() line(" + coords(x0 + tx, y0 + ty, x1 + tx, y1 + ty) + ",7)");
+      const auto clipped = screenAfter("cls() clip(" + coords(cx, cy, cw, ch) + ") line(" + coords(x0, y0, x1, y1) + ",7) clip()");
+
+      std::vector<color_t> expected(gfx::SCREEN_WIDTH * gfx::SCREEN_HEIGHT, color_t::BLACK);
+      for (coord_t y = cy; y < std::min(cy + ch, coord_t(gfx::SCREEN_HEIGHT)); ++y)
+        for (coord_t x = cx; x < std::min(cx + cw, coord_t(gfx::SCREEN_WIDTH)); ++x)
+          if (x + tx < gfx::SCREEN_WIDTH && y + ty < gfx::SCREEN_HEIGHT && x + tx >= 0 && y + ty >= 0)
+            expected[y * gfx::SCREEN_WIDTH + x] = reference[(y + ty) * gfx::SCREEN_WIDTH + x + tx];
+
+      REQUIRE(expected == clipped);
+    }
+
+    m.code().initFromSource("cls()");
+  }
+}
+
+TEST_CASE("circ(x, y, r, [col]) and circfill(x, y, r, [col])")
+{
+  auto at = [] (const std::vector<color_t>& pixels, coord_t x, coord_t y) {
+    return x >= 0 && x < gfx::SCREEN_WIDTH && y >= 0 && y < gfx::SCREEN_HEIGHT ? pixels[y * gfx::SCREEN_WIDTH + x] : color_t::BLACK;
+  };
+
+  SECTION("circles are symmetric and outlines lie on filled ones")
+  {
+    for (coord_t r = 0; r <= 40; ++r)
+    {
+      CAPTURE(r);
+      const auto filled = screenAfter("camera() fillp() clip() pal() cls() circfill(63,63," + std::to_string(r) + ",7)");
+      const auto outline = screenAfter("cls() circ(63,63," + std::to_string(r) + ",7)");
+
+      REQUIRE(at(filled, 63 - r, 63) == 7);
+      REQUIRE(at(filled, 63 - r - 1, 63) == 0);
+
+      for (coord_t y = 0; y < gfx::SCREEN_HEIGHT - 1; ++y)
+        for (coord_t x = 0; x < gfx::SCREEN_WIDTH - 1; ++x)
+        {
+          const color_t c = at(filled, x, y);
+          if (c != at(filled, 126 - x, y) || c != at(filled, x, 126 - y) || c != at(filled, y, x) || (at(outline, x, y) && !c))
+            FAIL("asymmetric circle or outline outside of it at " << x << "," << y);
+        }
+    }
+  }
+
+  SECTION("circles partially outside of screen or clip rect draw same pixels as on screen")
+  {
+    const auto reference = screenAfter("camera() fillp() clip() pal() cls() circfill(35,30,20,7) circ(35,30,24,8)");
+    const auto shifted = screenAfter("cls() clip(0,0,12,100) circfill(-5,10,20,7) circ(-5,10,24,8) clip()");
+
+    for (coord_t y = 0; y < gfx::SCREEN_HEIGHT; ++y)
+      for (coord_t x = 0; x < gfx::SCREEN_WIDTH; ++x)
+      {
+        CAPTURE(x, y);
+        REQUIRE(at(shifted, x, y) == (x < 12 && y < 100 ? at(reference, x + 40, y + 20) : color_t::BLACK));
+      }
+
+    m.code().initFromSource("cls()");
+  }
+}
+
+TEST_CASE("oval, rrect and trifill")
+{
+  const color_t* pixels = m.memory().screenPixels();
+
+  /* drawn pixels of top left corner of screen row by row */
+  auto drawn = [&] (const std::string& code, coord_t w, coord_t h) {
+    m.code().initFromSource("camera() fillp() clip() pal() cls() " + code);
+
+    std::string result;
+    for (coord_t y = 0; y < h; ++y)
+    {
+      for (coord_t x = 0; x < w; ++x)
+        result += pixels[y * gfx::SCREEN_WIDTH + x] ? '#' : '.';
+      result += y < h - 1 ? "/" : "";
+    }
+    return result;
+  };
+
+  SECTION("ovals of zero or one pixel size are lines or blocks")
+  {
+    REQUIRE(drawn("ovalfill(0,0,0,0,7)", 3, 3) == "#../.../...");
+    REQUIRE(drawn("ovalfill(0,0,3,0,7)", 5, 2) == "####./.....");
+    REQUIRE(drawn("oval(0,0,0,2,7)", 2, 4) == "#./#./#./..");
+    REQUIRE(drawn("ovalfill(0,0,1,1,7)", 3, 3) == "##./##./...");
+  }
+
+  SECTION("ovals are inscribed in their box whatever the corners order")
+  {
+    REQUIRE(drawn("ovalfill(0,0,4,2,7)", 6, 4) == ".###../#####./.###../......");
+    REQUIRE(drawn("ovalfill(4,2,0,0,7)", 6, 4) == ".###../#####./.###../......");
+    REQUIRE(drawn("oval(0,0,4,2,7)", 6, 4) == ".###../#...#./.###../......");
+    REQUIRE(drawn("oval(0,0,5,3,7)", 7, 5) == ".####../#....#./#....#./.####../.......");
+    REQUIRE(drawn("ovalfill(0,0,8,4,7)", 10, 6) == "..#####.../.#######../#########./.#######../..#####.../..........");
+    REQUIRE(drawn("oval(0,0,8,4,7)", 10, 6) == "..#####.../.#.....#../#.......#./.#.....#../..#####.../..........");
+  }
+
+  SECTION("ovals with same semi axes are circles")
+  {
+    REQUIRE(drawn("oval(0,0,4,4,7)", 6, 6) == drawn("circ(2,2,2,7)", 6, 6));
+    REQUIRE(drawn("ovalfill(0,0,10,10,7)", 12, 12) == drawn("circfill(5,5,5,7)", 12, 12));
+  }
+
+  SECTION("huge ovals and circles fill screen up to radius limit and are rejected above it")
+  {
+    const std::vector<color_t> full(gfx::SCREEN_WIDTH * gfx::SCREEN_HEIGHT, color_t(7)), empty(gfx::SCREEN_WIDTH * gfx::SCREEN_HEIGHT, color_t(0));
+    const auto draw = [] (const std::string& shape) { return screenAfter("camera() fillp() clip() pal() cls() " + shape); };
+
+    REQUIRE(draw("ovalfill(-32767,-32767,32767,32767,7)") == full);
+    REQUIRE(draw("ovalfill(-32767,-100,32767,200,7)") == full);
+    REQUIRE(draw("circfill(64,64,32767,7)") == full);
+    REQUIRE(draw("oval(-32767,-32767,32767,32767,7)") == empty);
+    REQUIRE(draw("circ(64,64,32767,7)") == empty);
+
+    REQUIRE(draw("ovalfill(-100000,-100000,100000,100000,7)") == empty);
+    REQUIRE(draw("ovalfill(-100,-100000,200,100000,7)") == empty);
+    REQUIRE(draw("circfill(64,64,100000,7)") == empty);
+    REQUIRE(draw("oval(-2000000000,-2000000000,2000000000,2000000000,7)") == empty);
+  }
+
+  SECTION("rounded rects limit radius to their shorter side")
+  {
+    REQUIRE(drawn("rrectfill(0,0,5,3,10,7)", 6, 4) == ".###../#####./.###../......");
+    REQUIRE(drawn("rrect(0,0,7,5,10,7)", 8, 6) == ".#####../#.....#./#.....#./#.....#./.#####../........");
+    REQUIRE(drawn("rrectfill(0,0,7,5,1,7)", 8, 6) == ".#####../#######./#######./#######./.#####../........");
+    REQUIRE(drawn("rrect(0,0,1,1,2,7)", 2, 2) == "#./..");
+    REQUIRE(drawn("rrect(0,0,0,3,1,7) rrectfill(0,0,3,0,1,7)", 4, 4) == "..../..../..../....");
+  }
+
+  SECTION("triangles")
+  {
+    REQUIRE(drawn("trifill(0,0,4,0,0,4,7)", 6, 6) == "#####./####../###.../##..../#...../......");
+    REQUIRE(drawn("trifill(2,0,0,4,4,4,7)", 6, 6) == "..#.../..##../.###../.####./#####./......");
+    REQUIRE(drawn("trifill(1,1,1,1,1,1,7)", 3, 3) == ".../.#./...");
+    REQUIRE(drawn("trifill(0,1,4,1,2,1,7)", 6, 3) == "....../#####./......");
+    REQUIRE(drawn("trifill(0,0,0,3,0,1,7)", 2, 5) == "#./#./#./#./..");
+  }
+}
+
+TEST_CASE("map(cx, cy, [sx, sy], [cw, ch], [layer])")
+{
+  SECTION("culled map draws same pixels as spr calls for every non empty tile on layer")
+  {
+    m.code().initFromSource("camera() fillp() clip() pal() palt() for i=0,63 do for j=0,7 do sset(i,j,1+(i*3+j)%15) end end "
+      "for i=0,15 do for j=0,15 do mset(i,j,(i*3+j*5)%8) end end for n=0,7 do fset(n,0,n%2==1) end");
+
+    const char* regions[] = { "0,0,0,0,16,16,0", "-3,-2,-4,5,10,10,0", "2,1,100,-6,8,8,1", "0,0,-200,0,16,16,0", "14,14,40,40,6,6,1" };
+
+    for (const char* region : regions)
+    {
+      CAPTURE(region);
+      const std::string setup = "cls() camera(3,-5) clip(10,2,100,90) ";
+      const auto expected = screenAfter(setup + "local cx,cy,x,y,cw,ch,layer=" + region + " for j=0,ch-1 do for i=0,cw-1 do local mx,my=cx+i,cy+j "
+        "if mx>=0 and my>=0 and mx<128 and my<64 then local n=mget(mx,my) if n~=0 and (layer==0 or band(fget(n),layer)~=0) then spr(n,x+i*8,y+j*8) end end end end camera() clip()");
+      REQUIRE(expected == screenAfter(setup + "map(" + region + ") camera() clip()"));
+    }
+
+    m.code().initFromSource("cls() memset(0,0,0x800) memset(0x2000,0,0x800) memset(0x3000,0,8)");
+  }
+
+  const color_t* pixels = m.memory().screenPixels();
+  auto screen = [&] () { return std::vector<color_t>(pixels, pixels + gfx::SCREEN_WIDTH * gfx::SCREEN_HEIGHT); };
+
+  SECTION("cached regions are drawn again after memory or palette changes")
+  {
+    auto change = GENERATE(as<std::string>{}, "mset(1,1,3)", "sset(9,1,0) sset(17,2,8)", "poke(0x2000+0x81,2)", "memset(0x2000,0,2)",
+      "poke(0x0004,0x77)", "fset(2,0,false) fset(1,0,true)", "pal(5,9)", "palt(0,false) palt(5,true)");
+
+    m.setMapCache(true);
+
+    for (int layer = 0; layer < 2; ++layer)
+    {
+      const std::string draw = " cls() map(0,0,0,0,4,4," + std::to_string(layer) + ")";
+
+      /* region is rendered into cache on its second request */
+      m.code().initFromSource("camera() fillp() clip() pal() palt() for i=0,63 do sset(8+i%8,flr(i/8),i%16) sset(16+i%8,flr(i/8),15-i%16) end "
+        "for y=0,3 do for x=0,3 do mset(x,y,1+(x+y)%3) end end fset(1,0,false) fset(2,0,true)" + draw);
+      m.code().initFromSource(draw);
+
+      m.code().initFromSource(change + draw);
+      const auto cached = screen();
+
+      m.code().initFromSource("cls() for y=0,3 do for x=0,3 do map(x,y,x*8,y*8,1,1," + std::to_string(layer) + ") end end");
+      REQUIRE(cached == screen());
+    }
+
+    m.setMapCache(R8_MAP_CACHE_ENABLED);
+  }
+}
+
+TEST_CASE("deferred drawing")
+{
+  SECTION("banded replay on many threads draws same pixels as immediate drawing")
+  {
+    const uint32_t seed = GENERATE(range(1, 11));
+    uint32_t state = seed;
+    m.font().load();
+    auto next = [&state] (int lo, int hi) { state = state * 1103515245 + 12345; return lo + int((state >> 16) % uint32_t(hi - lo + 1)); };
+    auto args = [&next] (size_t count) {
+      std::string result;
+      for (size_t i = 0; i < count; ++i)
+        result += (i ? "," : "") + std::to_string(next(-20, 147));
+      return result;
+    };
+
+    /* calls changing draw state and reading or writing memory are mixed with primitives crossing bands */
+    std::string script = "camera() clip() pal() palt() fillp() cls(1) for i=0,127 do for j=0,31 do sset(i,j,(i*3+j*5)%16) end end "
+      "for y=0,15 do for x=0,15 do mset(x,y,(x+y*16)%64) end end ";
+
+    for (int i = 0; i < 200; ++i)
+    {
+      const std::string color = std::to_string(next(0, 15));
+
+      switch (next(0, 19))
+      {
+        case 0: script += "rectfill(" + args(4) + "," + color + ")"; break;
+        case 1: script += "rect(" + args(4) + "," + color + ")"; break;
+        case 2: script += "line(" + args(4) + "," + color + ")"; break;
+        case 3: script += "circfill(" + args(2) + "," + std::to_string(next(0, 40)) + "," + color + ")"; break;
+        case 4: script += "circ(" + args(2) + "," + std::to_string(next(0, 40)) + "," + color + ")"; break;
+        case 5: script += "ovalfill(" + args(4) + "," + color + ")"; break;
+        case 6: script += "rrect(" + args(4) + "," + std::to_string(next(0, 10)) + "," + color + ")"; break;
+        case 7: script += "trifill(" + args(6) + "," + color + ")"; break;
+        case 8: script += "pset(" + args(2) + "," + color + ")"; break;
+        case 9: script += "spr(" + std::to_string(next(0, 63)) + "," + args(2) + ",2,2," + (next(0, 1) ? "true" : "false") + ")"; break;
+        case 10: script += "sspr(" + std::to_string(next(0, 64)) + ",0,16,16," + args(2) + "," + std::to_string(next(1, 60)) + "," + std::to_string(next(1, 60)) + ")"; break;
+        case 11: script += "map(0,0," + args(2) + ",16,16)"; break;
+        case 12: script += "tline(" + args(4) + ",0,0,0.125,0.0625)"; break;
+        case 13: script += "for k=0,9 do print(\"band\"..k.." + std::to_string(i) + "," + args(2) + "+k*6," + color + ") end"; break;
+        case 14: script += "sprbatch({" + std::to_string(next(1, 63)) + "," + args(2) + "," + std::to_string(next(1, 63)) + "," + args(2) + "})"; break;
+        case 15: script += "psetbatch({" + args(2) + "," + color + "," + args(2) + "," + color + "})"; break;
+        case 16: script += "clip(" + std::to_string(next(0, 64)) + "," + std::to_string(next(0, 64)) + "," + std::to_string(next(0, 100)) + "," + std::to_string(next(0, 100)) + ")"; break;
+        case 17: script += "camera(" + std::to_string(next(-16, 16)) + "," + std::to_string(next(-16, 16)) + ") pal(" + color + "," + std::to_string(next(0, 15)) + ")"; break;
+        case 18: script += "fillp(" + std::to_string(next(0, 0xffff)) + ") poke(0x6000+" + std::to_string(next(0, 0x1fff)) + "," + std::to_string(next(0, 255)) + ")"; break;
+        case 19: script += "pset(" + args(2) + ",pget(" + args(2) + ")) sset(" + std::to_string(next(0, 127)) + "," + std::to_string(next(0, 31)) + "," + color + ")"; break;
+      }
+
+      script += " ";
+    }
+
+    /* screen must be read again after every run since pokes leave it to be unpacked */
+    auto drawn = [&script] (size_t threads) {
+      m.setDrawThreads(threads);
+      m.code().initFromSource(script);
+      const color_t* pixels = m.memory().screenPixels();
+      return std::vector<color_t>(pixels, pixels + gfx::SCREEN_WIDTH * gfx::SCREEN_HEIGHT);
+    };
+
+    const auto immediate = drawn(1);
+
+    /* 3 bands don't split screen evenly */
+    for (size_t threads = 2; threads <= 4; ++threads)
+    {
+      CAPTURE(threads);
+      REQUIRE(immediate == drawn(threads));
+    }
+
+    m.setDrawThreads(1);
+  }
+
+  SECTION("recorded text is drawn before cache evicts it")
+  {
+    m.font().load();
+    const std::string script = "camera() clip() pal() fillp() cls() for i=0," + std::to_string(gfx::TextRunCache::DEFAULT_CAPACITY * 2) + " do print(i,(i%8)*16,flr(i/8)*6,1+i%15) end";
+
+    auto drawn = [&script] (size_t threads) {
+      m.setDrawThreads(threads);
+      m.code().initFromSource(script);
+      const color_t* pixels = m.memory().screenPixels();
+      return std::vector<color_t>(pixels, pixels + gfx::SCREEN_WIDTH * gfx::SCREEN_HEIGHT);
+    };
+
+    const auto immediate = drawn(1);
+    REQUIRE(std::count(immediate.begin(), immediate.end(), color_t::BLACK) < immediate.size());
+    REQUIRE(immediate == drawn(4));
+    m.setDrawThreads(1);
+  }
+}
+
 TEST_CASE("mid")
 {
   Machine m;
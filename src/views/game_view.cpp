@@ -123,36 +123,64 @@ retro8::io::PngData loadPng(const std::string& path)
   return pngData;
 }
 
-r8::gfx::ColorTable colorTable;
+/* tables are mapped through display format so they are valid for any channel layout of the same depth,
+   BGR565 displays, common on 16 bits handhelds, get a table built from their own format instead */
+r8::gfx::ColorTable<r8::gfx::XRGB8888> colorTable;
+r8::gfx::ScreenConverter<r8::gfx::XRGB8888> screenConverter;
+r8::gfx::ColorTable<r8::gfx::RGB565> colorTable16;
+r8::gfx::ScreenConverter<r8::gfx::RGB565> screenConverter16;
+r8::gfx::ColorTable<r8::gfx::BGR565> colorTableBGR565;
+r8::gfx::ScreenConverter<r8::gfx::BGR565> screenConverterBGR565;
+
+using OutputFormat = r8::gfx::OutputFormat;
+OutputFormat outputFormat = OutputFormat::XRGB8888;
+
+static void invalidateConverters()
+{
+  screenConverter.invalidate();
+  screenConverter16.invalidate();
+  screenConverterBGR565.invalidate();
+}
 
 struct ColorMapper
 {
   const SDL_PixelFormat* format;
   ColorMapper(const SDL_PixelFormat* format) : format(format) { }
 
-  inline r8::gfx::ColorTable::pixel_t operator()(uint8_t r, uint8_t g, uint8_t b) const
+  inline uint32_t operator()(uint8_t r, uint8_t g, uint8_t b) const
   {
     return SDL_MapRGB(format, r, g, b);
   }
 };
 
+#if !defined(SDL12)
 void GameView::rasterize()
 {
-  auto* data = machine.memory().screenData();
-  auto* screenPalette = machine.memory().paletteAt(r8::gfx::SCREEN_PALETTE_INDEX);
-  uint32_t* output = _output.pixels();
+  /* only band of rows modified since last frame is converted, straight into output memory */
+  auto& memory = machine.memory();
+  const auto rows = outputFormat == OutputFormat::RGB565 ? screenConverter16.changedRows(memory, colorTable16)
+    : outputFormat == OutputFormat::BGR565 ? screenConverterBGR565.changedRows(memory, colorTableBGR565)
+    : screenConverter.changedRows(memory, colorTable);
 
-  for (size_t i = 0; i < r8::gfx::BYTES_PER_SCREEN; ++i)
+  if (rows.first < rows.second)
   {
-    const r8::gfx::color_byte_t* pixels = data + i;
-    const auto rc1 = colorTable.get(screenPalette->get((pixels)->low()));
-    const auto rc2 = colorTable.get(screenPalette->get((pixels)->high()));
+    int pitch;
+    void* pixels = _output.lock(rows.first, rows.second - rows.first, pitch);
+
+    if (pixels)
+    {
+      if (outputFormat == OutputFormat::RGB565)
+        screenConverter16.convertRows(memory, rows.first, rows.second, static_cast<uint16_t*>(pixels), pitch);
+      else if (outputFormat == OutputFormat::BGR565)
+        screenConverterBGR565.convertRows(memory, rows.first, rows.second, static_cast<uint16_t*>(pixels), pitch);
+      else
+        screenConverter.convertRows(memory, rows.first, rows.second, static_cast<uint32_t*>(pixels), pitch);
 
-    *(output) = rc1;
-    *((output)+1) = rc2;
-    (output) += 2;
+      _output.unlock();
+    }
   }
 }
+#endif
 
 
 
@@ -163,14 +191,26 @@ void GameView::render()
   {
     LOGD("Initializing color table");
     auto* format = manager->displayFormat();
-    colorTable.init(ColorMapper(manager->displayFormat()));
+    outputFormat = r8::gfx::outputFormatFor(format->BytesPerPixel, format->Rmask, format->Gmask, format->Bmask);
+
+    /* displays which can't be written to directly get XRGB8888 pixels through a buffer converted by SDL */
+    if (outputFormat == OutputFormat::UNSUPPORTED)
+    {
+      printf("Unsupported display pixel format, converting from XRGB8888\n");
+      colorTable.init();
+    }
+    else
+      colorTable.init(ColorMapper(format));
+    colorTable16.init(ColorMapper(format));
+    colorTableBGR565.init();
 
 #if !defined(SDL12)
     printf("Using renderer pixel format: %s\n", SDL_GetPixelFormatName(format->format));
 #endif
 
-    /* initialize main surface and its texture */
-    _output = manager->allocate(128, 128);
+#if !defined(SDL12)
+    /* main output is a streaming texture in display format which is converted into directly, or an XRGB8888 one if it's unsupported */
+    _output = manager->allocateTexture(128, 128, outputFormat == OutputFormat::UNSUPPORTED ? uint32_t(SDL_PIXELFORMAT_ARGB8888) : format->format);
 
     if (!_output)
     {
@@ -178,6 +218,13 @@ void GameView::render()
     }
 
     assert(_output);
+#else
+    if (outputFormat == OutputFormat::UNSUPPORTED)
+      _output = manager->allocate(manager->screen()->w, manager->screen()->h);
+#endif
+
+    /* new output has no content yet */
+    invalidateConverters();
 
     _frameCounter = 0;
 
@@ -232,17 +279,18 @@ void GameView::render()
 
   auto* renderer = manager->renderer();
 
+#if !defined(SDL12)
   manager->clear(0, 0, 0);
+#endif
 
-  if (!_paused)
-  {
-    if (!_initFuture.valid() || _initFuture.wait_for(std::chrono::nanoseconds(0)) == std::future_status::ready)
-    {
-      update();
-      rasterize();
-    }
+  const bool ready = !_initFuture.valid() || _initFuture.wait_for(std::chrono::nanoseconds(0)) == std::future_status::ready;
 
-    _output.update();
+  if (!_paused && ready)
+  {
+    update();
+#if !defined(SDL12)
+    rasterize();
+#endif
   }
 
   SDL_Rect dest;
@@ -251,10 +299,58 @@ void GameView::render()
     dest = { (SCREEN_WIDTH - 128) / 2, (SCREEN_HEIGHT - 128) / 2, 128, 128 };
   else if (_scaler == Scaler::SCALED_ASPECT_2x)
     dest = { (SCREEN_WIDTH - 256) / 2, (SCREEN_HEIGHT - 256) / 2, 256, 256 };
+  else if (_scaler == Scaler::SCALED_ASPECT_3x)
+    dest = { (SCREEN_WIDTH - 384) / 2, (SCREEN_HEIGHT - 384) / 2, 384, 384 };
+  else if (_scaler == Scaler::SCALED_ASPECT_FIT)
+  {
+    constexpr int size = SCREEN_WIDTH < SCREEN_HEIGHT ? SCREEN_WIDTH : SCREEN_HEIGHT;
+    dest = { (SCREEN_WIDTH - size) / 2, (SCREEN_HEIGHT - size) / 2, size, size };
+  }
   else
     dest = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
 
+#if defined(SDL12)
+  /* conversion and scaling are done in a single pass straight into display surface, which keeps its content
+     between frames so that only changed rows are written, it's cleared and fully converted again when
+     destination changes or something else is drawn over it, unsupported displays get a 32 bits buffer blitted by SDL instead */
+  SDL_Surface* screen = _output ? _output.surface : manager->screen();
+  const bool moved = _scaleMap.rows.empty() || dest.x != _scaleRect.x || dest.y != _scaleRect.y || dest.w != _scaleRect.w || dest.h != _scaleRect.h;
+
+  if (moved)
+  {
+    _scaleMap = r8::gfx::scale_map_t::nearest(dest.x, dest.y, dest.w, dest.h, screen->w, screen->h);
+    _scaleRect = dest;
+  }
+
+  if (moved || _showFPS || !ready)
+  {
+    manager->clear(0, 0, 0);
+    if (_output)
+      SDL_FillRect(_output.surface, nullptr, 0);
+    invalidateConverters();
+  }
+
+  if (ready)
+  {
+    if (SDL_MUSTLOCK(screen))
+      SDL_LockSurface(screen);
+
+    if (outputFormat == OutputFormat::RGB565)
+      screenConverter16.convertScaled(machine.memory(), colorTable16, static_cast<uint16_t*>(screen->pixels), screen->pitch, _scaleMap);
+    else if (outputFormat == OutputFormat::BGR565)
+      screenConverterBGR565.convertScaled(machine.memory(), colorTableBGR565, static_cast<uint16_t*>(screen->pixels), screen->pitch, _scaleMap);
+    else
+      screenConverter.convertScaled(machine.memory(), colorTable, static_cast<uint32_t*>(screen->pixels), screen->pitch, _scaleMap);
+
+    if (SDL_MUSTLOCK(screen))
+      SDL_UnlockSurface(screen);
+  }
+
+  if (_output)
+    manager->blit(_output, 0, 0);
+#else
   manager->blitToScreen(_output, dest);
+#endif
 
   if (_showFPS)
   {
@@ -438,6 +534,10 @@ void GameView::pause()
 void GameView::resume()
 {
   _paused = false;
+#if defined(SDL12)
+  /* menu was drawn over display surface */
+  _scaleMap.rows.clear();
+#endif
 
 #if SOUND_ENABLED
   sdlAudio.resume();
@@ -446,7 +546,8 @@ void GameView::resume()
 
 GameView::~GameView()
 {
-  _output.release();
+  if (_output)
+    _output.release();
   //TODO: the _init future is not destroyed
   sdlAudio.close();
 }
@@ -19,6 +19,8 @@ namespace ui
   {
     UNSCALED = 0,
     SCALED_ASPECT_2x,
+    SCALED_ASPECT_3x,
+    SCALED_ASPECT_FIT,
     FULLSCREEN,
 
     FIRST = UNSCALED,
@@ -29,13 +31,21 @@ namespace ui
   {
   private:
     uint32_t _frameCounter;
+#if PLATFORM == PLATFORM_FUNKEY
+    /* FunKey display is 240x240 so screen is fit to it by default */
+    Scaler _scaler = Scaler::SCALED_ASPECT_FIT;
+#else
     Scaler _scaler = Scaler::UNSCALED;
+#endif
 
     ViewManager* manager;
 
     retro8::input::InputManager _input;
 
     Surface _output;
+    /* software scaling map of SDL1.2, rebuilt when destination rect changes */
+    retro8::gfx::scale_map_t _scaleMap;
+    SDL_Rect _scaleRect;
 
     std::string _path;
 
@@ -46,7 +56,9 @@ namespace ui
     bool _showFPS;
     bool _showCartridgeName;
 
+#if !defined(SDL12)
     void rasterize();
+#endif
     void render();
     void update();
 
@@ -132,6 +132,8 @@ void MenuView::updateLabels()
   switch (scaler) {
   case Scaler::UNSCALED: scalerLabel += "1:1"; break;
   case Scaler::SCALED_ASPECT_2x: scalerLabel += "2:1"; break;
+  case Scaler::SCALED_ASPECT_3x: scalerLabel += "3:1"; break;
+  case Scaler::SCALED_ASPECT_FIT: scalerLabel += "fit aspect"; break;
   case Scaler::FULLSCREEN: scalerLabel += "fit screen"; break;
   }
 
@@ -20,7 +20,7 @@ struct Surface
 
   Surface() : surface(nullptr), texture(nullptr) { }
 
-  operator bool() const { return surface != nullptr; }
+  operator bool() const { return surface != nullptr || texture != nullptr; }
 
   void enableBlending() { assert(texture); SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND); }
   void releaseSurface() { if (surface) SDL_FreeSurface(surface); surface = nullptr; }
@@ -33,6 +33,17 @@ struct Surface
   }
 
   void update() { SDL_UpdateTexture(texture, nullptr, surface->pixels, surface->pitch); }
+
+  /* rows of a streaming texture are written directly, locked ones must be rewritten completely since their content is lost */
+  void* lock(int y, int h, int& pitch)
+  {
+    int width;
+    SDL_QueryTexture(texture, nullptr, nullptr, &width, nullptr);
+    const SDL_Rect rect = { 0, y, width, h };
+    void* pixels = nullptr;
+    return SDL_LockTexture(texture, &rect, &pixels, &pitch) == 0 ? pixels : nullptr;
+  }
+  void unlock() { SDL_UnlockTexture(texture); }
   inline uint32_t& pixel(size_t index) { return pixels()[index]; }
   inline uint32_t* pixels() { return static_cast<uint32_t*>(surface->pixels); }
 };
@@ -108,8 +119,13 @@ public:
   }
 
   Surface allocate(int width, int height);
+#if !defined(SDL12)
+  /* streaming texture without a backing surface */
+  Surface allocateTexture(int width, int height, uint32_t format);
+#endif
 
   const SDL_PixelFormat* displayFormat() { return _format; }
+  SDL_Surface* screen() { return _screen; }
 
   void setFrameRate(u32 frameRate)
   {
@@ -55,11 +55,20 @@ void SDL<EventHandler, Renderer>::deinit()
 template<typename EventHandler, typename Renderer>
 Surface SDL<EventHandler, Renderer>::allocate(int width, int height)
 {
-  SDL_Surface* surface = SDL_CreateRGBSurface(0, width, height, 32, _format->Rmask, _format->Gmask, _format->Bmask, _format->Amask);
-  SDL_Texture* texture = SDL_CreateTexture(_renderer, _format->format, SDL_TEXTUREACCESS_STREAMING, width, width);
+  /* surfaces are always 32 bits, in display layout unless display has a different depth */
+  SDL_Surface* surface = _format->BitsPerPixel == 32
+    ? SDL_CreateRGBSurface(0, width, height, 32, _format->Rmask, _format->Gmask, _format->Bmask, _format->Amask)
+    : SDL_CreateRGBSurface(0, width, height, 32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000);
+  SDL_Texture* texture = SDL_CreateTexture(_renderer, surface->format->format, SDL_TEXTUREACCESS_STREAMING, width, width);
   return { surface, texture };
 }
 
+template<typename EventHandler, typename Renderer>
+Surface SDL<EventHandler, Renderer>::allocateTexture(int width, int height, uint32_t format)
+{
+  return { nullptr, SDL_CreateTexture(_renderer, format, SDL_TEXTUREACCESS_STREAMING, width, height) };
+}
+
 template<typename EventHandler, typename Renderer>
 void SDL<EventHandler, Renderer>::blitToScreen(const Surface& surface, const SDL_Rect& rect)
 {
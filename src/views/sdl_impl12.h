@@ -13,9 +13,9 @@ bool SDL<EventHandler, Renderer>::init()
   SDL_EnableKeyRepeat(0, 0);
 
 #if defined(WINDOW_SCALE)
-  _screen = SDL_SetVideoMode(SCREEN_WIDTH*2, SCREEN_HEIGHT*2, 32, SDL_HWSURFACE);
+  _screen = SDL_SetVideoMode(SCREEN_WIDTH*2, SCREEN_HEIGHT*2, SCREEN_BPP, SDL_HWSURFACE);
   #else
-  _screen = SDL_SetVideoMode(SCREEN_WIDTH, SCREEN_HEIGHT, 32, SDL_HWSURFACE);
+  _screen = SDL_SetVideoMode(SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_BPP, SDL_HWSURFACE);
 #endif
 
   _format = _screen->format;
@@ -113,7 +113,10 @@ void SDL<EventHandler, Renderer>::deinit()
 template<typename EventHandler, typename Renderer>
 Surface SDL<EventHandler, Renderer>::allocate(int width, int height)
 {
-  SDL_Surface* surface = SDL_CreateRGBSurface(0, width, height, 32, _format->Rmask, _format->Gmask, _format->Bmask, _format->Amask);
+  /* surfaces are always 32 bits, in display layout unless display has a different depth */
+  SDL_Surface* surface = _format->BitsPerPixel == 32
+    ? SDL_CreateRGBSurface(0, width, height, 32, _format->Rmask, _format->Gmask, _format->Bmask, _format->Amask)
+    : SDL_CreateRGBSurface(0, width, height, 32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000);
   return { surface };
 }
 
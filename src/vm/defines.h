@@ -36,6 +36,7 @@ namespace retro8
   using color_index_t = uint8_t;
   using palette_index_t = size_t;
   using address_t = int32_t;
+  using fixed_t = int32_t; // 16.16 fixed point
   struct point_t { coord_t x, y; };
 
   static constexpr coord_t TEXT_LINE_HEIGHT = 6;
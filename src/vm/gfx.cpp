@@ -1,11 +1,87 @@
 #include "gfx.h"
+#include "memory.h"
 
 #include "gen/pico_font.h"
 
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+  #define R8_SIMD_X86 1
+  #include <immintrin.h>
+  #if defined(_MSC_VER)
+    #include <intrin.h>
+    #define R8_TARGET(isa)
+  #else
+    #define R8_TARGET(isa) __attribute__((target(isa)))
+  #endif
+#elif defined(__ARM_NEON) && (!defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  #define R8_SIMD_NEON 1
+  #include <arm_neon.h>
+#endif
+
 
 using namespace retro8;
 using namespace retro8::gfx;
 
+static const struct { const char* encoding; size_t index; } SpecialGlyphs[] = {
+  { "\xe2\xac\x87\xef\xb8\x8f", 3 }, // down arrow
+  { "\xe2\xac\x86\xef\xb8\x8f", 20 }, // up arrow
+  { "\xe2\xac\x85\xef\xb8\x8f", 11 }, // left arrow
+  { "\xe2\x9e\xa1\xef\xb8\x8f", 17 }, // right arrow
+  { "\xf0\x9f\x85\xbe\xef\xb8\x8f", 14 }, // o button
+  { "\xe2\x9d\x8e", 23 }, // x button
+
+  // 0x8b left, 0x91 right, 0x94 up, 0x83 down, 0x8e o, 0x97 x
+  { "\x8b", 11 }, { "\x91", 17 }, { "\x94", 20 }, { "\x83", 3 }, { "\x8e", 14 }, { "\x97", 23 }
+};
+
+Font::Font() : glyphs(), trie(1, trie_node_t{ {}, -1 }), loads(0)
+{
+  for (const auto& special : SpecialGlyphs)
+  {
+    size_t node = 0;
+
+    for (const char* c = special.encoding; *c; ++c)
+    {
+      const uint8_t byte = *c;
+
+      if (!trie[node].next[byte])
+      {
+        trie[node].next[byte] = uint8_t(trie.size());
+        trie.push_back(trie_node_t{ {}, -1 });
+      }
+
+      node = trie[node].next[byte];
+    }
+
+    trie[node].glyph = int16_t(SPECIAL_GLYPHS_BASE + special.index);
+  }
+
+  assert(trie.size() <= 256);
+}
+
+size_t Font::decode(const char* text, size_t available, size_t& length) const
+{
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(text);
+
+  /* encodings are prefix free so first terminal node reached is the match */
+  for (size_t i = 0, node = 0; i < available; ++i)
+  {
+    node = trie[node].next[bytes[i]];
+
+    if (!node)
+      break;
+    else if (trie[node].glyph >= 0)
+    {
+      length = i + 1;
+      return trie[node].glyph;
+    }
+  }
+
+  length = 1;
+  return bytes[0] < SPECIAL_GLYPHS_BASE ? bytes[0] : INVALID_GLYPH;
+}
+
 void Font::load()
 {
   // 128 x 80 bitmap (1 bit per pixel)
@@ -17,6 +93,8 @@ void Font::load()
   
   static_assert(TOTAL_BYTES == sizeof(font_map) / sizeof(font_map[0]), "Must be equal");
   static_assert(BYTES_PER_ROW == 128, "");
+
+  ++loads;
   
   for (size_t i = 0; i < TOTAL_BYTES; ++i)
   {
@@ -26,14 +104,15 @@ void Font::load()
     const size_t y = (i - (row * BYTES_PER_ROW)) / FONT_GLYPHS_COLUMNS;
 
     const auto byte = font_map[i];
-    sequential_sprite_t& glyph = glyphs[index];
-    
+    glyph_row_t& bits = glyphs[index][y];
+
+    bits = 0;
     for (size_t j = 0; j < BITS_PER_BYTE; ++j)
     {
       const bool s = (byte & (1 << (BITS_PER_BYTE - j - 1))) != 0;
       const size_t x = ((i * BITS_PER_BYTE) + j) % 8;
 
-      glyph.set(x, y, s ? color_t::WHITE : color_t::BLACK);
+      bits |= s ? (1 << x) : 0;
     }
   }
 }
@@ -44,19 +123,721 @@ void Font::load(const uint8_t* data)
 
   constexpr size_t pitch = SPRITE_WIDTH * FONT_GLYPHS_COLUMNS;
 
+  ++loads;
+
   for (size_t gy = 0; gy < FONT_GLYPHS_ROWS; ++gy)
     for (size_t gx = 0; gx < FONT_GLYPHS_COLUMNS; ++gx)
     {
-      sequential_sprite_t& glyph = glyphs[gy*FONT_GLYPHS_COLUMNS + gx];
+      auto& glyph = glyphs[gy*FONT_GLYPHS_COLUMNS + gx];
 
       for (size_t sy = 0; sy < SPRITE_HEIGHT; ++sy)
+      {
+        glyph[sy] = 0;
+
         for (size_t sx = 0; sx < SPRITE_WIDTH; ++sx)
         {
           size_t bx = gx * SPRITE_WIDTH;
           size_t by = gy * SPRITE_HEIGHT;
           size_t index = (by + sy) * pitch + bx + sx;
 
-          glyph.set(sx, sy, data[index] ? color_t::WHITE : color_t::BLACK);
+          glyph[sy] |= data[index] ? (1 << sx) : 0;
         }
+      }
     }
 }
+
+void SpriteSheetCache::update(const color_byte_t* sheet, uint32_t generation)
+{
+  for (size_t y = 0; y < SPRITE_SHEET_HEIGHT; ++y)
+  {
+    for (size_t sx = 0; sx < SPRITES_PER_SPRITE_SHEET_ROW; ++sx)
+    {
+      color_mask_t mask = 0;
+
+      for (size_t x = sx * SPRITE_WIDTH; x < (sx + 1) * SPRITE_WIDTH; ++x)
+      {
+        const color_t color = sheet[y * SPRITE_SHEET_PITCH + x / PIXEL_TO_BYTE_RATIO].get(x);
+        _pixels[y * SPRITE_SHEET_WIDTH + x] = color;
+        mask |= 1 << color;
+      }
+
+      _rowColors[y * SPRITES_PER_SPRITE_SHEET_ROW + sx] = mask;
+    }
+  }
+
+  _generation = generation;
+  ++_boundsStamp;
+}
+
+void SpriteSheetCache::computeBounds(size_t index, color_mask_t transparent)
+{
+  const coord_t sx = (index % SPRITES_PER_SPRITE_SHEET_ROW) * SPRITE_WIDTH, sy = (index / SPRITES_PER_SPRITE_SHEET_ROW) * SPRITE_HEIGHT;
+  bounds_t bounds = { SPRITE_WIDTH, SPRITE_HEIGHT, 0, 0 };
+
+  for (coord_t y = 0; y < coord_t(SPRITE_HEIGHT); ++y)
+  {
+    /* rows without opaque colors don't need to be scanned */
+    if (!(_rowColors[(sy + y) * SPRITES_PER_SPRITE_SHEET_ROW + sx / SPRITE_WIDTH] & ~transparent))
+      continue;
+
+    bounds.y0 = std::min(bounds.y0, y);
+    bounds.y1 = y + 1;
+
+    const color_t* pixels = row(sx, sy + y);
+    for (coord_t x = 0; x < coord_t(SPRITE_WIDTH); ++x)
+    {
+      if (!(transparent & (1 << pixels[x])))
+      {
+        bounds.x0 = std::min(bounds.x0, x);
+        bounds.x1 = std::max(bounds.x1, x + 1);
+      }
+    }
+  }
+
+  if (bounds.x0 >= bounds.x1)
+    bounds = { 0, 0, 0, 0 };
+
+  _bounds[index] = bounds;
+  _boundsStamps[index] = _boundsStamp;
+}
+
+void DrawState::update(const palette_t* palette, const clip_rect_t* clip, const camera_t* camera, const fill_pattern_t* fill, uint32_t generation)
+{
+  cameraX = camera->x();
+  cameraY = camera->y();
+
+  /* clip rect can be poked with any value so it's restricted to screen, every primitive relies on it */
+  clipX0 = std::min<coord_t>(clip->x0, SCREEN_WIDTH);
+  clipY0 = std::min<coord_t>(clip->y0, SCREEN_HEIGHT);
+  clipX1 = std::min<coord_t>(clip->x1, SCREEN_WIDTH);
+  clipY1 = std::min<coord_t>(clip->y1, SCREEN_HEIGHT);
+
+  for (size_t i = 0; i < COLOR_COUNT; ++i)
+    remap[i] = palette->get(color_t(i));
+  transparent = palette->transparencyMask();
+
+  pattern = fill->pattern();
+  patternTransparent = fill->transparent();
+
+  _generation = generation;
+}
+
+/* integer midpoint walk of the part of an ellipse with semi axes a along u and b along v where
+   its slope is under 1, starting from (0, b), decision is scaled by 4 to stay integer */
+template<typename F>
+static void walkEllipse(int64_t a, int64_t b, F visit)
+{
+  int64_t u = 0, v = b, d = 4 * b * b - 4 * a * a * b + a * a;
+
+  while (v >= 0 && b * b * u <= a * a * v)
+  {
+    visit(coord_t(u), coord_t(v));
+
+    ++u;
+
+    if (d < 0)
+      d += 4 * b * b * (2 * u + 1);
+    else
+    {
+      --v;
+      d += 4 * (b * b * (2 * u + 1) - 2 * a * a * v);
+    }
+  }
+}
+
+void CircleSpanCache::compute(amount_t a, amount_t b, std::vector<coord_t>& table)
+{
+  table.assign(b + 1, 0);
+
+  /* every point of the two walks widens the row it lies on, for a circle they are its two octants */
+  walkEllipse(b, a, [&table] (coord_t row, coord_t width) {
+    if (row < coord_t(table.size()))
+      table[row] = std::max(table[row], width);
+  });
+
+  walkEllipse(a, b, [&table] (coord_t width, coord_t row) {
+    table[row] = std::max(table[row], width);
+  });
+}
+
+const std::vector<coord_t>& CircleSpanCache::ovalHalfWidths(amount_t w, amount_t h)
+{
+  /* odd sizes have two center columns or rows so semi axes are the same of the size below */
+  if (w / 2 == h / 2)
+    return halfWidths(w / 2);
+
+  compute(w / 2, h / 2, _oval);
+  return _oval;
+}
+
+constexpr color_t MapLayerCache::HOLE;
+
+void MapLayerCache::layer_t::renderTile(coord_t tx, coord_t ty, sprite_index_t index, bool visible, const SpriteSheetCache& sheet)
+{
+  const coord_t sx = (index % SPRITES_PER_SPRITE_SHEET_ROW) * SPRITE_WIDTH, sy = (index / SPRITES_PER_SPRITE_SHEET_ROW) * SPRITE_HEIGHT;
+
+  for (coord_t y = 0; y < coord_t(SPRITE_HEIGHT); ++y)
+  {
+    const color_t* src = sheet.row(sx, sy + y);
+    color_t* dest = &pixels[(ty * SPRITE_HEIGHT + y) * width() + tx * SPRITE_WIDTH];
+
+    for (coord_t x = 0; x < coord_t(SPRITE_WIDTH); ++x)
+      dest[x] = visible && !(transparent & (1 << src[x])) ? remap[src[x]] : HOLE;
+  }
+}
+
+void MapLayerCache::layer_t::computeRuns(coord_t y)
+{
+  const color_t* row = &pixels[y * width()];
+  auto& spans = runs[y];
+
+  spans.clear();
+
+  for (coord_t x = 0; x < width(); )
+  {
+    if (row[x] == HOLE)
+    {
+      ++x;
+      continue;
+    }
+
+    const coord_t start = x;
+    while (x < width() && row[x] != HOLE) ++x;
+
+    spans.push_back({ start, x });
+  }
+}
+
+MapLayerCache::layer_t& MapLayerCache::get(coord_t x0, coord_t y0, coord_t x1, coord_t y1, sprite_flags_t mask)
+{
+  for (auto it = _layers.begin(); it != _layers.end(); ++it)
+  {
+    if (it->x0 == x0 && it->y0 == y0 && it->x1 == x1 && it->y1 == y1 && it->mask == mask)
+    {
+      _layers.splice(_layers.begin(), _layers, it);
+      return _layers.front();
+    }
+  }
+
+  _layers.emplace_front();
+
+  layer_t& layer = _layers.front();
+  layer.x0 = x0;
+  layer.y0 = y0;
+  layer.x1 = x1;
+  layer.y1 = y1;
+  layer.mask = mask;
+  layer.requested = false;
+  layer.valid = false;
+
+  if (_layers.size() > CAPACITY)
+    _layers.pop_back();
+
+  return layer;
+}
+
+const std::vector<coord_t>& CircleSpanCache::halfWidths(amount_t radius)
+{
+  if (radius > MAX_CACHED_RADIUS)
+  {
+    compute(radius, radius, _scratch);
+    return _scratch;
+  }
+
+  if (radius >= amount_t(_tables.size()))
+    _tables.resize(radius + 1);
+
+  if (_tables[radius].empty())
+    compute(radius, radius, _tables[radius]);
+
+  return _tables[radius];
+}
+
+template<typename P>
+static void convertScalar(const color_t* src, P* dest, size_t count, const pixel_lookup_t<P>& lookup)
+{
+  for (size_t i = 0; i < count; ++i)
+    dest[i] = lookup.pixels[src[i]];
+}
+
+/* vector kernels look up each byte of 16 pixels at once through a byte shuffle of the matching
+   plane, then interleave the planes back into pixels, so output is identical to scalar one */
+
+#if R8_SIMD_X86
+R8_TARGET("ssse3") static void convertSSSE3(const color_t* src, uint32_t* dest, size_t count, const pixel_lookup_t<uint32_t>& lookup)
+{
+  const __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lookup.planes[0].data()));
+  const __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lookup.planes[1].data()));
+  const __m128i p2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lookup.planes[2].data()));
+  const __m128i p3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lookup.planes[3].data()));
+
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16)
+  {
+    const __m128i index = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    const __m128i b0 = _mm_shuffle_epi8(p0, index), b1 = _mm_shuffle_epi8(p1, index);
+    const __m128i b2 = _mm_shuffle_epi8(p2, index), b3 = _mm_shuffle_epi8(p3, index);
+    const __m128i lo01 = _mm_unpacklo_epi8(b0, b1), hi01 = _mm_unpackhi_epi8(b0, b1);
+    const __m128i lo23 = _mm_unpacklo_epi8(b2, b3), hi23 = _mm_unpackhi_epi8(b2, b3);
+
+    __m128i* out = reinterpret_cast<__m128i*>(dest + i);
+    _mm_storeu_si128(out, _mm_unpacklo_epi16(lo01, lo23));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(lo01, lo23));
+    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(hi01, hi23));
+    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(hi01, hi23));
+  }
+
+  convertScalar(src + i, dest + i, count - i, lookup);
+}
+
+R8_TARGET("ssse3") static void convertSSSE3(const color_t* src, uint16_t* dest, size_t count, const pixel_lookup_t<uint16_t>& lookup)
+{
+  const __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lookup.planes[0].data()));
+  const __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lookup.planes[1].data()));
+
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16)
+  {
+    const __m128i index = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    const __m128i b0 = _mm_shuffle_epi8(p0, index), b1 = _mm_shuffle_epi8(p1, index);
+
+    __m128i* out = reinterpret_cast<__m128i*>(dest + i);
+    _mm_storeu_si128(out, _mm_unpacklo_epi8(b0, b1));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi8(b0, b1));
+  }
+
+  convertScalar(src + i, dest + i, count - i, lookup);
+}
+
+template<typename P>
+R8_TARGET("avx2") static inline void loadPlanes(__m256i* planes, const pixel_lookup_t<P>& lookup)
+{
+  for (size_t p = 0; p < sizeof(P); ++p)
+  {
+    const __m128i plane = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lookup.planes[p].data()));
+    planes[p] = _mm256_inserti128_si256(_mm256_castsi128_si256(plane), plane, 1);
+  }
+}
+
+R8_TARGET("avx2") static void convertAVX2(const color_t* src, uint32_t* dest, size_t count, const pixel_lookup_t<uint32_t>& lookup)
+{
+  __m256i planes[4];
+  loadPlanes(planes, lookup);
+
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32)
+  {
+    const __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    const __m256i b0 = _mm256_shuffle_epi8(planes[0], index), b1 = _mm256_shuffle_epi8(planes[1], index);
+    const __m256i b2 = _mm256_shuffle_epi8(planes[2], index), b3 = _mm256_shuffle_epi8(planes[3], index);
+    const __m256i lo01 = _mm256_unpacklo_epi8(b0, b1), hi01 = _mm256_unpackhi_epi8(b0, b1);
+    const __m256i lo23 = _mm256_unpacklo_epi8(b2, b3), hi23 = _mm256_unpackhi_epi8(b2, b3);
+
+    /* unpacks work inside 128 bits lanes so these hold pixels 0-3|16-19, 4-7|20-23, 8-11|24-27, 12-15|28-31 */
+    const __m256i q0 = _mm256_unpacklo_epi16(lo01, lo23), q1 = _mm256_unpackhi_epi16(lo01, lo23);
+    const __m256i q2 = _mm256_unpacklo_epi16(hi01, hi23), q3 = _mm256_unpackhi_epi16(hi01, hi23);
+
+    __m256i* out = reinterpret_cast<__m256i*>(dest + i);
+    _mm256_storeu_si256(out, _mm256_permute2x128_si256(q0, q1, 0x20));
+    _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(q2, q3, 0x20));
+    _mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(q0, q1, 0x31));
+    _mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(q2, q3, 0x31));
+  }
+
+  convertScalar(src + i, dest + i, count - i, lookup);
+}
+
+R8_TARGET("avx2") static void convertAVX2(const color_t* src, uint16_t* dest, size_t count, const pixel_lookup_t<uint16_t>& lookup)
+{
+  __m256i planes[2];
+  loadPlanes(planes, lookup);
+
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32)
+  {
+    const __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    const __m256i b0 = _mm256_shuffle_epi8(planes[0], index), b1 = _mm256_shuffle_epi8(planes[1], index);
+
+    /* pixels 0-7|16-23 and 8-15|24-31 */
+    const __m256i lo = _mm256_unpacklo_epi8(b0, b1), hi = _mm256_unpackhi_epi8(b0, b1);
+
+    __m256i* out = reinterpret_cast<__m256i*>(dest + i);
+    _mm256_storeu_si256(out, _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(lo, hi, 0x31));
+  }
+
+  convertScalar(src + i, dest + i, count - i, lookup);
+}
+#endif
+
+#if R8_SIMD_NEON
+/* interleaving stores rebuild pixels from planes */
+static inline void storePlanes(uint32_t* dest, const uint8x16_t* planes) { vst4q_u8(reinterpret_cast<uint8_t*>(dest), uint8x16x4_t{ { planes[0], planes[1], planes[2], planes[3] } }); }
+static inline void storePlanes(uint16_t* dest, const uint8x16_t* planes) { vst2q_u8(reinterpret_cast<uint8_t*>(dest), uint8x16x2_t{ { planes[0], planes[1] } }); }
+static inline void storePlanes(uint32_t* dest, const uint8x8_t* planes) { vst4_u8(reinterpret_cast<uint8_t*>(dest), uint8x8x4_t{ { planes[0], planes[1], planes[2], planes[3] } }); }
+static inline void storePlanes(uint16_t* dest, const uint8x8_t* planes) { vst2_u8(reinterpret_cast<uint8_t*>(dest), uint8x8x2_t{ { planes[0], planes[1] } }); }
+
+template<typename P>
+static void convertNEON(const color_t* src, P* dest, size_t count, const pixel_lookup_t<P>& lookup)
+{
+  constexpr size_t PLANES = sizeof(P);
+  const uint8_t* index = reinterpret_cast<const uint8_t*>(src);
+
+  size_t i = 0;
+#if defined(__aarch64__)
+  uint8x16_t planes[PLANES], bytes[PLANES];
+  for (size_t p = 0; p < PLANES; ++p)
+    planes[p] = vld1q_u8(lookup.planes[p].data());
+
+  for (; i + 16 <= count; i += 16)
+  {
+    const uint8x16_t indices = vld1q_u8(index + i);
+    for (size_t p = 0; p < PLANES; ++p)
+      bytes[p] = vqtbl1q_u8(planes[p], indices);
+    storePlanes(dest + i, bytes);
+  }
+#else
+  uint8x8x2_t planes[PLANES];
+  uint8x8_t bytes[PLANES];
+  for (size_t p = 0; p < PLANES; ++p)
+  {
+    planes[p].val[0] = vld1_u8(lookup.planes[p].data());
+    planes[p].val[1] = vld1_u8(lookup.planes[p].data() + 8);
+  }
+
+  for (; i + 8 <= count; i += 8)
+  {
+    const uint8x8_t indices = vld1_u8(index + i);
+    for (size_t p = 0; p < PLANES; ++p)
+      bytes[p] = vtbl2_u8(planes[p], indices);
+    storePlanes(dest + i, bytes);
+  }
+#endif
+
+  convertScalar(src + i, dest + i, count - i, lookup);
+}
+#endif
+
+/* x86 kernels are found by checking cpu features at runtime, NEON is assumed when compiled for,
+   kernels are sorted from slowest to fastest starting from scalar one */
+template<typename P> using convert_kernel_t = void(*)(const color_t*, P*, size_t, const pixel_lookup_t<P>&);
+
+template<typename P>
+static std::vector<convert_kernel_t<P>> availableKernels()
+{
+  std::vector<convert_kernel_t<P>> kernels = { convertScalar<P> };
+
+#if R8_SIMD_X86
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  const int leaves = info[0];
+  __cpuid(info, 1);
+  const bool ssse3 = (info[2] & (1 << 9)) != 0;
+  const bool avxEnabled = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 0x6) == 0x6;
+  bool avx2 = false;
+  if (leaves >= 7 && avxEnabled)
+  {
+    __cpuidex(info, 7, 0);
+    avx2 = (info[1] & (1 << 5)) != 0;
+  }
+#else
+  __builtin_cpu_init();
+  const bool ssse3 = __builtin_cpu_supports("ssse3"), avx2 = __builtin_cpu_supports("avx2");
+#endif
+  if (ssse3)
+    kernels.push_back(static_cast<convert_kernel_t<P>>(convertSSSE3));
+  if (avx2)
+    kernels.push_back(static_cast<convert_kernel_t<P>>(convertAVX2));
+#elif R8_SIMD_NEON
+  kernels.push_back(convertNEON<P>);
+#endif
+
+  return kernels;
+}
+
+template<typename F>
+ScreenConverter<F>::ScreenConverter() : _table(nullptr), _tableGeneration(0)
+{
+  static const kernel_t kernel = availableKernels<pixel_t>().back();
+  _kernel = kernel;
+}
+
+template<typename F>
+std::vector<typename ScreenConverter<F>::kernel_t> ScreenConverter<F>::kernels()
+{
+  return availableKernels<pixel_t>();
+}
+
+template<typename F>
+bool ScreenConverter<F>::refresh(const palette_t* palette, const ColorTable<F>& table)
+{
+  bool changed = _table != &table || _tableGeneration != table.generation();
+
+  for (size_t i = 0; i < COLOR_COUNT && !changed; ++i)
+    changed = _palette[i] != palette->get(color_t(i));
+
+  if (changed)
+  {
+    for (size_t i = 0; i < COLOR_COUNT; ++i)
+    {
+      _palette[i] = palette->get(color_t(i));
+      _lookup.pixels[i] = table.get(_palette[i]);
+
+      for (size_t p = 0; p < _lookup.planes.size(); ++p)
+        _lookup.planes[p][i] = uint8_t(_lookup.pixels[i] >> (p * 8));
+    }
+
+    _table = &table;
+    _tableGeneration = table.generation();
+  }
+
+  return changed;
+}
+
+/* dirty rows which were redrawn with same content as last converted one are skipped too,
+   so that frames completely redrawn every time can still be detected as unchanged */
+template<typename F>
+bool ScreenConverter<F>::isRowChanged(Memory& memory, const color_t* src, coord_t y) const
+{
+  const size_t offset = y * SCREEN_WIDTH;
+  return memory.isRowDirty(y) && memcmp(src + offset, _converted.data() + offset, SCREEN_WIDTH) != 0;
+}
+
+template<typename F>
+std::pair<coord_t, coord_t> ScreenConverter<F>::changedRows(Memory& memory, const ColorTable<F>& table)
+{
+  const color_t* src = memory.screenPixels();
+  if (refresh(memory.paletteAt(SCREEN_PALETTE_INDEX), table))
+    return std::make_pair(coord_t(0), coord_t(SCREEN_HEIGHT));
+
+  coord_t first = SCREEN_HEIGHT, last = 0;
+
+  for (coord_t y = 0; y < coord_t(SCREEN_HEIGHT); ++y)
+  {
+    if (isRowChanged(memory, src, y))
+    {
+      first = std::min(first, y);
+      last = y + 1;
+    }
+  }
+
+  return std::make_pair(first, last);
+}
+
+template<typename F>
+void ScreenConverter<F>::convertRows(Memory& memory, coord_t first, coord_t last, pixel_t* dest, size_t pitch)
+{
+  const color_t* src = memory.screenPixels();
+  uint8_t* row = reinterpret_cast<uint8_t*>(dest);
+
+  for (coord_t y = first; y < last; ++y, row += pitch)
+    _kernel(src + y * SCREEN_WIDTH, reinterpret_cast<pixel_t*>(row), SCREEN_WIDTH, _lookup);
+
+  if (first < last)
+    std::copy(src + first * SCREEN_WIDTH, src + last * SCREEN_WIDTH, _converted.begin() + first * SCREEN_WIDTH);
+  memory.clearDirtyRows();
+}
+
+template<typename F>
+std::pair<coord_t, coord_t> ScreenConverter<F>::convert(Memory& memory, const ColorTable<F>& table, pixel_t* dest)
+{
+  const color_t* src = memory.screenPixels();
+  /* a new lookup invalidates every row already converted */
+  const bool all = refresh(memory.paletteAt(SCREEN_PALETTE_INDEX), table);
+
+  coord_t first = SCREEN_HEIGHT, last = 0;
+
+  /* every row is compared once, before any run is converted */
+  std::array<bool, SCREEN_HEIGHT> changed;
+  for (coord_t y = 0; y < coord_t(SCREEN_HEIGHT); ++y)
+    changed[y] = all || isRowChanged(memory, src, y);
+
+  for (coord_t y = 0; y < coord_t(SCREEN_HEIGHT); )
+  {
+    if (!changed[y])
+    {
+      ++y;
+      continue;
+    }
+
+    /* consecutive changed rows are converted as a single run */
+    coord_t end = y + 1;
+    while (end < coord_t(SCREEN_HEIGHT) && changed[end])
+      ++end;
+
+    const size_t offset = y * SCREEN_WIDTH, count = (end - y) * SCREEN_WIDTH;
+    _kernel(src + offset, dest + offset, count, _lookup);
+    std::copy(src + offset, src + offset + count, _converted.begin() + offset);
+
+    first = std::min(first, y);
+    last = end;
+    y = end;
+  }
+
+  memory.clearDirtyRows();
+
+  return std::make_pair(first, last);
+}
+
+template<typename F>
+std::pair<coord_t, coord_t> ScreenConverter<F>::convertScaled(Memory& memory, const ColorTable<F>& table, pixel_t* dest, size_t pitch, const scale_map_t& map)
+{
+  const auto rows = changedRows(memory, table);
+  if (rows.first >= rows.second)
+    return rows;
+
+  const color_t* src = memory.screenPixels();
+  uint8_t* row = reinterpret_cast<uint8_t*>(dest) + map.y * pitch + map.x * sizeof(pixel_t);
+  const size_t bytes = map.columns.size() * sizeof(pixel_t);
+
+  for (size_t r = 0; r < map.rows.size(); ++r, row += pitch)
+  {
+    const coord_t y = map.rows[r];
+
+    if (y < rows.first || y >= rows.second)
+      continue;
+    else if (r > 0 && map.rows[r - 1] == y)
+      std::memcpy(row, row - pitch, bytes);
+    else
+    {
+      const color_t* source = src + y * SCREEN_WIDTH;
+      pixel_t* out = reinterpret_cast<pixel_t*>(row);
+
+      for (size_t c = 0; c < map.columns.size(); ++c)
+        out[c] = _lookup.pixels[source[map.columns[c]]];
+    }
+  }
+
+  std::copy(src + rows.first * SCREEN_WIDTH, src + rows.second * SCREEN_WIDTH, _converted.begin() + rows.first * SCREEN_WIDTH);
+  memory.clearDirtyRows();
+
+  return rows;
+}
+
+scale_map_t scale_map_t::nearest(coord_t x, coord_t y, coord_t width, coord_t height, coord_t destWidth, coord_t destHeight)
+{
+  scale_map_t map;
+  map.x = std::max(x, 0);
+  map.y = std::max(y, 0);
+
+  for (coord_t dx = map.x; dx < std::min(x + width, destWidth); ++dx)
+    map.columns.push_back((dx - x) * coord_t(SCREEN_WIDTH) / width);
+  for (coord_t dy = map.y; dy < std::min(y + height, destHeight); ++dy)
+    map.rows.push_back((dy - y) * coord_t(SCREEN_HEIGHT) / height);
+
+  return map;
+}
+
+OutputFormat gfx::outputFormatFor(size_t bytesPerPixel, uint32_t rmask, uint32_t gmask, uint32_t bmask)
+{
+  if (bytesPerPixel == 4)
+    return OutputFormat::XRGB8888;
+  else if (bytesPerPixel != 2)
+    return OutputFormat::UNSUPPORTED;
+  else if (rmask == 0x001f && gmask == 0x07e0 && bmask == 0xf800)
+    return OutputFormat::BGR565;
+  else
+    return OutputFormat::RGB565;
+}
+
+template class gfx::ScreenConverter<XRGB8888>;
+template class gfx::ScreenConverter<RGB565>;
+template class gfx::ScreenConverter<BGR565>;
+
+void TextRunCache::rasterize(const Font& font, const std::string& text, run_t& run)
+{
+  /* glyphs are laid out twice, first to size the mask and then to set its bits */
+  for (int pass = 0; pass < 2; ++pass)
+  {
+    coord_t x = 0, y = 0;
+    bool lit = false;
+
+    for (size_t i = 0; i < text.length(); )
+    {
+      if (text[i] == '\n')
+      {
+        y += TEXT_LINE_HEIGHT;
+        x = 0;
+        ++i;
+        continue;
+      }
+
+      size_t length;
+      const size_t index = font.decode(text.data() + i, text.length() - i, length);
+      const coord_t width = font.glyphWidth(index);
+      i += length;
+
+      if (index != Font::INVALID_GLYPH)
+      {
+        const Font::glyph_row_t* rows = font.glyph(index);
+
+        for (coord_t ty = 0; ty < GLYPH_HEIGHT; ++ty)
+        {
+          const uint32_t mask = rows[ty] & ((1 << width) - 1);
+
+          if (pass == 0)
+          {
+            if (mask)
+            {
+              run.width = std::max(run.width, x + width);
+              run.height = std::max(run.height, y + ty + 1);
+            }
+          }
+          else
+          {
+            uint32_t* row = run.bits.data() + (y + ty) * run.stride;
+
+            for (coord_t tx = 0; (mask >> tx) != 0; ++tx)
+              if (mask & (1 << tx))
+                row[(x + tx) / 32] |= 1u << ((x + tx) % 32);
+          }
+
+          lit |= mask != 0;
+        }
+      }
+
+      x += width;
+    }
+
+    if (!lit)
+      return;
+    else if (pass == 0)
+    {
+      run.stride = (run.width + 31) / 32;
+      run.bits.assign(run.stride * run.height, 0);
+    }
+  }
+}
+
+const TextRunCache::run_t& TextRunCache::get(const Font& font, const std::string& text)
+{
+  if (font.generation() != _fontGeneration)
+  {
+    clear();
+    _fontGeneration = font.generation();
+  }
+
+  auto it = _index.find(text);
+
+  if (it != _index.end())
+  {
+    ++_hits;
+    _entries.splice(_entries.begin(), _entries, it->second);
+    return it->second->second;
+  }
+
+  ++_misses;
+
+  _entries.emplace_front(text, run_t());
+  rasterize(font, text, _entries.front().second);
+  _index[text] = _entries.begin();
+
+  if (_entries.size() > _capacity)
+  {
+    _index.erase(_entries.back().first);
+    _entries.pop_back();
+  }
+
+  return _entries.front().second;
+}
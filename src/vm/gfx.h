@@ -3,10 +3,16 @@
 #include "defines.h"
 
 #include <array>
+#include <vector>
+#include <list>
+#include <string>
+#include <unordered_map>
 #include <cassert>
 
 namespace retro8
 {
+  class Memory;
+
   namespace gfx
   {
     static constexpr size_t PIXEL_TO_BYTE_RATIO = 2;
@@ -43,17 +49,40 @@ namespace retro8
 
     static constexpr size_t COLOR_COUNT = 16;
     
-    //TODO: optimize by generating it the same format as the destination surface
+    /* output pixel formats, each one encodes an RGB color into its own pixel type */
+    struct XRGB8888
+    {
+      using pixel_t = uint32_t;
+      pixel_t operator()(uint8_t r, uint8_t g, uint8_t b) const { return 0xff000000 | (r << 16) | (g << 8) | b; }
+    };
+
+    struct RGB565
+    {
+      using pixel_t = uint16_t;
+      pixel_t operator()(uint8_t r, uint8_t g, uint8_t b) const { return pixel_t(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3)); }
+    };
+
+    struct BGR565
+    {
+      using pixel_t = uint16_t;
+      pixel_t operator()(uint8_t r, uint8_t g, uint8_t b) const { return pixel_t(((b >> 3) << 11) | ((g >> 2) << 5) | (r >> 3)); }
+    };
 
+    template<typename F>
     struct ColorTable
     {
     public:
-      using pixel_t = uint32_t;
+      using format_t = F;
+      using pixel_t = typename F::pixel_t;
 
     private:
       std::array<pixel_t, COLOR_COUNT> table;
+      uint32_t _generation = 0;
 
     public:
+      void init() { init(F()); }
+
+      /* a custom mapper can be used when pixel layout is only known at runtime, eg. from a display format */
       template<typename B>
       void init(const B& mapper)
       {
@@ -68,8 +97,10 @@ namespace retro8
 
         for (size_t i = 0; i < COLOR_COUNT; ++i)
           table[i] = mapper(colors[i].r, colors[i].g, colors[i].b);
+        ++_generation;
       }
       pixel_t get(color_t c) const { return table[c]; }
+      uint32_t generation() const { return _generation; }
     };
 
     
@@ -124,18 +155,6 @@ namespace retro8
       inline color_byte_t& byteAt(coord_t x, coord_t y) { return reinterpret_cast<color_byte_t*>(this)[y * SPRITE_SHEET_PITCH + x / 2]; }
     };
 
-    class sequential_sprite_t
-    {
-      color_byte_t data[32];
-
-      inline const color_byte_t& byteAt(coord_t x, coord_t y) const { return static_cast<const color_byte_t&>(((sequential_sprite_t*)this)->byteAt(x, y)); }
-      inline color_byte_t& byteAt(coord_t x, coord_t y) { return data[y * SPRITE_BYTES_PER_SPRITE_ROW + x / 2]; }
-
-    public:
-      color_t get(coord_t x, coord_t y) const { return byteAt(x, y).get(x); }
-      void set(coord_t x, coord_t y, color_t color) { byteAt(x, y).set(x, color); }
-    };
-
     class palette_t
     {
       std::array<uint8_t, COLOR_COUNT> colors;
@@ -162,8 +181,17 @@ namespace retro8
       color_t operator[](color_t i) { return get(i); }
       bool transparent(color_t i) const { return (colors[i] & 0x10) != 0; }
       void transparent(color_t i, bool f) { colors[i] = f ? (colors[i] | 0x10) : (colors[i] & 0x0f); }
+
+      uint16_t transparencyMask() const
+      {
+        uint16_t mask = 0;
+        for (size_t i = 0; i < COLOR_COUNT; ++i)
+          mask |= transparent(color_t(i)) ? (1 << i) : 0;
+        return mask;
+      }
     };
 
+    /* x0, y0 are inclusive while x1, y1 are exclusive */
     struct clip_rect_t
     {
       uint8_t x0;
@@ -171,7 +199,7 @@ namespace retro8
       uint8_t x1;
       uint8_t y1;
 
-      void reset() { x0 = y0 = 0; x1 = SCREEN_WIDTH - 1; y1 = SCREEN_HEIGHT - 1; }
+      void reset() { x0 = y0 = 0; x1 = SCREEN_WIDTH; y1 = SCREEN_HEIGHT; }
       void set(uint8_t xs, uint8_t ys, uint8_t xe, uint8_t ye) { x0 = xs; y0 = ys; x1 = xe; y1 = ye; }
     };
 
@@ -185,6 +213,13 @@ namespace retro8
       uint8_t y() const { return _y; }
     };
 
+    /* tline() wraps map coordinates inside a width x height tiles region placed at x, y, a size of 0 disables wrapping */
+    struct map_wrap_t
+    {
+      uint8_t width, height;
+      uint8_t x, y;
+    };
+
     struct camera_t
     {
 
@@ -203,14 +238,336 @@ namespace retro8
 
     };
 
+    /* fill pattern as stored in draw state, 4x4 bits with the top left pixel in the most significant bit */
+    struct fill_pattern_t
+    {
+      uint8_t _low, _high;
+      uint8_t _flags;
+
+      uint16_t pattern() const { return _low | (_high << 8); }
+      bool transparent() const { return (_flags & 0x01) != 0; }
+      void set(uint16_t pattern, bool transparent) { _low = pattern & 0xff; _high = pattern >> 8; _flags = transparent ? 0x01 : 0x00; }
+    };
+
+    /* how a primitive paints its pixels, pixels whose pattern bit is set use the secondary
+       color or are skipped if the pattern is transparent, colors are already remapped */
+    struct fill_t
+    {
+      color_t primary, secondary;
+      uint16_t pattern;
+      bool transparent;
+
+      fill_t() : fill_t(color_t::BLACK) { }
+      fill_t(color_t color) : primary(color), secondary(color), pattern(0), transparent(false) { }
+      fill_t(color_t primary, color_t secondary, uint16_t pattern, bool transparent) : primary(primary), secondary(secondary), pattern(pattern), transparent(transparent) { }
+
+      bool solid() const { return pattern == 0; }
+      /* pattern bits for row y, bit (3 - x % 4) is set when pixel x is not painted with primary color */
+      uint8_t row(coord_t y) const { return (pattern >> (12 - (y & 3) * 4)) & 0x0f; }
+      bool alternate(coord_t x, coord_t y) const { return (row(y) & (0x08 >> (x & 3))) != 0; }
+    };
+
+    /* draw state resolved from memory, primitives read it instead of camera, clip rect, draw palette
+       and fill pattern memory, it's rebuilt only when memory in draw state range has been modified */
+    class DrawState
+    {
+    private:
+      uint32_t _generation;
+
+    public:
+      coord_t cameraX, cameraY;
+      /* x0, y0 are inclusive while x1, y1 are exclusive */
+      coord_t clipX0, clipY0, clipX1, clipY1;
+      std::array<color_t, COLOR_COUNT> remap;
+      uint16_t transparent;
+      uint16_t pattern;
+      bool patternTransparent;
+
+      DrawState() : _generation(0) { }
+
+      bool isValid(uint32_t generation) const { return _generation == generation; }
+      void update(const palette_t* palette, const clip_rect_t* clip, const camera_t* camera, const fill_pattern_t* fill, uint32_t generation);
+
+      inline color_t color(color_t c) const { return remap[c % COLOR_COUNT]; }
+      inline bool isTransparent(color_t c) const { return (transparent & (1 << c)) != 0; }
+      inline bool contains(coord_t x, coord_t y) const { return x >= clipX0 && x < clipX1 && y >= clipY0 && y < clipY1; }
+
+      /* secondary color of a patterned fill is specified by the high nibble of the color */
+      fill_t fill(color_t c) const { return fill_t(color(c), color(color_t(c >> 4)), pattern, patternTransparent); }
+    };
+
+    /* lit pixels of a printed string relative to its origin, each row is stride words of 1 bit per pixel with bit x set if pixel x is lit */
+    struct text_mask_t
+    {
+      coord_t width, height;
+      size_t stride;
+      std::vector<uint32_t> bits;
+
+      text_mask_t() : width(0), height(0), stride(0) { }
+
+      bool empty() const { return bits.empty(); }
+      inline const uint32_t* row(coord_t y) const { return bits.data() + y * stride; }
+    };
+
+    /* a draw call reduced to one of the span engine or blitter entry points, it can be executed right away
+       or recorded and executed later, data points to the row widths or batch entries the command needs and mask to printed text */
+    struct DrawCommand
+    {
+      enum Type : uint8_t
+      {
+        PIXEL, PIXELS, FILL_SPAN, FILL_RECT, FILL_COLUMN, LINE, FILL_SYMMETRIC, STROKE_SYMMETRIC, FILL_TRIANGLE, FILL_MASK,
+        BLIT_SPRITE, BLIT_SPRITES, STRETCH_SPRITE, TEXTURED_LINE
+      };
+
+      static constexpr uint8_t FLIP_X = 0x01;
+      static constexpr uint8_t FLIP_Y = 0x02;
+
+      Type type;
+      uint8_t flags;
+      std::array<int32_t, 10> args;
+      fill_t fill;
+      const coord_t* data;
+      uint32_t length;
+      const text_mask_t* mask;
+    };
+
+    /* sprite sheet decoded to one byte per pixel, together with the set of colors used
+       by each row of every sprite so that blitters can skip or bulk copy whole rows */
+    class SpriteSheetCache
+    {
+    public:
+      using color_mask_t = uint16_t;
+
+      /* opaque pixels of a sprite relative to its origin, x1 and y1 are exclusive, empty sprites have no area */
+      struct bounds_t
+      {
+        coord_t x0, y0, x1, y1;
+        bool empty() const { return x0 >= x1; }
+      };
+
+    private:
+      std::array<color_t, SPRITE_SHEET_WIDTH * SPRITE_SHEET_HEIGHT> _pixels;
+      std::array<color_mask_t, SPRITE_COUNT * SPRITE_HEIGHT> _rowColors;
+      uint32_t _generation;
+
+      /* bounds depend on transparency too so they're computed lazily, a sprite is up to date when its stamp matches */
+      std::array<bounds_t, SPRITE_COUNT> _bounds;
+      std::array<uint32_t, SPRITE_COUNT> _boundsStamps;
+      uint32_t _boundsStamp;
+      color_mask_t _boundsTransparent;
+
+      void computeBounds(size_t index, color_mask_t transparent);
+
+    public:
+      SpriteSheetCache() : _generation(0), _boundsStamps(), _boundsStamp(1), _boundsTransparent(0) { }
+
+      bool isValid(uint32_t generation) const { return _generation == generation; }
+      void update(const color_byte_t* sheet, uint32_t generation);
+
+      inline const color_t* row(coord_t x, coord_t y) const { return &_pixels[y * SPRITE_SHEET_WIDTH + x]; }
+      inline color_t get(coord_t x, coord_t y) const { return _pixels[y * SPRITE_SHEET_WIDTH + x]; }
+
+      /* colors used by row y of the sprites spanning [x, x + w) */
+      color_mask_t rowColors(coord_t x, coord_t y, coord_t w) const
+      {
+        color_mask_t mask = 0;
+        for (coord_t sx = x / SPRITE_WIDTH; sx <= (x + w - 1) / coord_t(SPRITE_WIDTH); ++sx)
+          mask |= _rowColors[y * SPRITES_PER_SPRITE_SHEET_ROW + sx];
+        return mask;
+      }
+
+      const bounds_t& bounds(sprite_index_t index, color_mask_t transparent)
+      {
+        if (transparent != _boundsTransparent)
+        {
+          _boundsTransparent = transparent;
+          ++_boundsStamp;
+        }
+
+        if (_boundsStamps[index] != _boundsStamp)
+          computeBounds(index, transparent);
+
+        return _bounds[index];
+      }
+    };
+
+    /* regions of the tile map pre-rendered with the draw palette, pixels where nothing is drawn are holes
+       and every row keeps the runs of drawn pixels so that a region can be drawn by copying them */
+    class MapLayerCache
+    {
+    public:
+      static constexpr color_t HOLE = color_t(0x10);
+      static constexpr size_t CAPACITY = 8;
+      static constexpr amount_t MIN_CACHED_TILES = 16;
+
+      struct run_t { coord_t x0, x1; };
+
+      struct layer_t
+      {
+        /* region of tile map with x1, y1 exclusive and layer mask the region was drawn with */
+        coord_t x0, y0, x1, y1;
+        sprite_flags_t mask;
+
+        /* regions are rendered only when requested again so that one-off regions don't pay for it */
+        bool requested;
+
+        /* state from which pixels have been rendered, used to find which tiles are out of date */
+        bool valid;
+        uint32_t sheetGeneration, mapGeneration;
+        std::array<color_t, COLOR_COUNT> remap;
+        uint16_t transparent;
+        std::vector<sprite_index_t> tiles;
+        std::array<uint8_t, SPRITE_SHEET_PITCH * SPRITE_SHEET_HEIGHT> sheetData;
+        std::array<sprite_flags_t, SPRITE_COUNT> flags;
+
+        std::vector<color_t> pixels;
+        std::vector<std::vector<run_t>> runs;
+
+        coord_t width() const { return (x1 - x0) * SPRITE_WIDTH; }
+        coord_t height() const { return (y1 - y0) * SPRITE_HEIGHT; }
+
+        void renderTile(coord_t tx, coord_t ty, sprite_index_t index, bool visible, const SpriteSheetCache& sheet);
+        void computeRuns(coord_t y);
+      };
+
+    private:
+      std::list<layer_t> _layers;
+
+    public:
+      layer_t& get(coord_t x0, coord_t y0, coord_t x1, coord_t y1, sprite_flags_t mask);
+      void clear() { _layers.clear(); }
+    };
+
+    /* half width of every row of a circle, indexed by distance from center row,
+       tables are computed lazily once per radius and shared by all round primitives */
+    class CircleSpanCache
+    {
+    public:
+      static constexpr amount_t MAX_CACHED_RADIUS = 256;
+      /* largest semi axis a PICO-8 coordinate can express, it keeps the integer walk far from overflowing */
+      static constexpr amount_t MAX_RADIUS = 0x7fff;
+
+    private:
+      std::vector<std::vector<coord_t>> _tables;
+      std::vector<coord_t> _scratch;
+      std::vector<coord_t> _oval;
+
+      /* ellipse with semi axes a and b, a circle when they're equal */
+      static void compute(amount_t a, amount_t b, std::vector<coord_t>& table);
+
+    public:
+      const std::vector<coord_t>& halfWidths(amount_t radius);
+
+      /* same as above for an oval inscribed in a box of (w+1)x(h+1) pixels, widths are relative
+         to the one or two center columns and rows are counted from the one or two center rows,
+         ovals with same semi axes share circle tables */
+      const std::vector<coord_t>& ovalHalfWidths(amount_t w, amount_t h);
+    };
+
+    /* lookup is also split in byte planes so that vector kernels can use it as 16 entries byte shuffles */
+    template<typename P>
+    struct pixel_lookup_t
+    {
+      std::array<P, COLOR_COUNT> pixels;
+      std::array<std::array<uint8_t, COLOR_COUNT>, sizeof(P)> planes;
+    };
+
+    /* nearest neighbour mapping of the visible part of a scaled screen placed at (x, y) inside a
+       destination, columns and rows hold the source coordinate of each visible pixel */
+    struct scale_map_t
+    {
+      coord_t x, y;
+      std::vector<coord_t> columns, rows;
+
+      static scale_map_t nearest(coord_t x, coord_t y, coord_t width, coord_t height, coord_t destWidth, coord_t destHeight);
+    };
+
+    /* layout written for a display format of given bytes per pixel and channel masks, other 16 and 32 bits layouts
+       are written through color tables mapped to display format, other depths can't be written to directly */
+    enum class OutputFormat { XRGB8888, RGB565, BGR565, UNSUPPORTED };
+    OutputFormat outputFormatFor(size_t bytesPerPixel, uint32_t rmask, uint32_t gmask, uint32_t bmask);
+
+    /* converts screen to frontend pixels through a lookup merging screen palette and color table,
+       which is rebuilt only when one of them changes, only dirty rows are converted otherwise */
+    template<typename F>
+    class ScreenConverter
+    {
+    public:
+      using pixel_t = typename F::pixel_t;
+      using lookup_t = pixel_lookup_t<pixel_t>;
+      using kernel_t = void(*)(const color_t* src, pixel_t* dest, size_t count, const lookup_t& lookup);
+
+    private:
+      lookup_t _lookup;
+      std::array<color_t, COLOR_COUNT> _palette;
+      std::array<color_t, SCREEN_WIDTH * SCREEN_HEIGHT> _converted;
+      const ColorTable<F>* _table;
+      uint32_t _tableGeneration;
+      kernel_t _kernel;
+
+      bool refresh(const palette_t* palette, const ColorTable<F>& table);
+      bool isRowChanged(Memory& memory, const color_t* src, coord_t y) const;
+
+    public:
+      ScreenConverter();
+
+      /* forces next conversion of the whole screen, eg. when destination buffer is new */
+      void invalidate() { _table = nullptr; }
+
+      /* kernels usable on this cpu from scalar one to the fastest, which is used by default */
+      static std::vector<kernel_t> kernels();
+      void setKernel(kernel_t kernel) { _kernel = kernel; invalidate(); }
+
+      /* returns range [first, last) of converted rows, empty if nothing changed */
+      std::pair<coord_t, coord_t> convert(Memory& memory, const ColorTable<F>& table, pixel_t* dest);
+
+      /* same as above in two steps for destinations which must be written completely, like locked
+         streaming textures, the range is found first then every row in it is converted into dest,
+         which points to first row and has given pitch in bytes */
+      std::pair<coord_t, coord_t> changedRows(Memory& memory, const ColorTable<F>& table);
+      void convertRows(Memory& memory, coord_t first, coord_t last, pixel_t* dest, size_t pitch);
+
+      /* converts and scales changed rows in a single pass into a destination with given pitch in bytes,
+         output rows mapping to the same source row are copied from the previous one, returns range
+         [first, last) of converted source rows, nothing is written if it's empty */
+      std::pair<coord_t, coord_t> convertScaled(Memory& memory, const ColorTable<F>& table, pixel_t* dest, size_t pitch, const scale_map_t& map);
+    };
+
     class Font
     {
-      sequential_sprite_t glyphs[FONT_GLYPHS_ROWS*FONT_GLYPHS_COLUMNS];
+    public:
+      using glyph_row_t = uint8_t;
+
+      static constexpr size_t GLYPH_COUNT = FONT_GLYPHS_ROWS * FONT_GLYPHS_COLUMNS;
+      static constexpr size_t SPECIAL_GLYPHS_BASE = 128;
+      static constexpr size_t INVALID_GLYPH = GLYPH_COUNT;
+
+    private:
+      /* glyphs are stored as 1 bit per pixel rows, bit x is set if pixel x is lit */
+      std::array<std::array<glyph_row_t, SPRITE_HEIGHT>, GLYPH_COUNT> glyphs;
+
+      /* byte indexed trie of the UTF-8 encodings of special glyphs, node 0 is root and a 0 link is missing */
+      struct trie_node_t
+      {
+        std::array<uint8_t, 256> next;
+        int16_t glyph;
+      };
+
+      std::vector<trie_node_t> trie;
+
+      /* bumped by every load so that text rasterized with previous glyphs can be discarded */
+      uint32_t loads;
 
     public:
-      Font() { }
-      inline const sequential_sprite_t* glyph(char c) const { return c < 128 ? &glyphs[c] : nullptr; }
-      inline const sequential_sprite_t* specialGlyph(size_t i) const { return &glyphs[128+i]; }
+      Font();
+
+      inline const glyph_row_t* glyph(size_t index) const { return glyphs[index].data(); }
+      inline coord_t glyphWidth(size_t index) const { return index >= SPECIAL_GLYPHS_BASE ? SPRITE_WIDTH : GLYPH_WIDTH; }
+
+      /* glyph at the start of text, length is set to amount of bytes consumed, INVALID_GLYPH if there is none */
+      size_t decode(const char* text, size_t available, size_t& length) const;
+
+      uint32_t generation() const { return loads; }
 
       void load();
 
@@ -218,6 +575,39 @@ namespace retro8
       void load(const uint8_t* data);
     };
 
+    /* whole printed strings rasterized to 1bpp masks, least recently used strings are evicted so that
+       text printed every frame is rasterized once, everything is discarded when the font is loaded again */
+    class TextRunCache
+    {
+    public:
+      using run_t = text_mask_t;
+
+      static constexpr size_t DEFAULT_CAPACITY = 64;
+
+    private:
+      using entry_t = std::pair<std::string, run_t>;
+
+      std::list<entry_t> _entries;
+      std::unordered_map<std::string, std::list<entry_t>::iterator> _index;
+      size_t _capacity;
+      size_t _hits, _misses;
+      uint32_t _fontGeneration;
+
+      static void rasterize(const Font& font, const std::string& text, run_t& run);
+
+    public:
+      TextRunCache(size_t capacity = DEFAULT_CAPACITY) : _capacity(capacity), _hits(0), _misses(0), _fontGeneration(0) { }
+
+      const run_t& get(const Font& font, const std::string& text);
+      bool contains(const std::string& text) const { return _index.find(text) != _index.end(); }
+      void clear() { _entries.clear(); _index.clear(); }
+
+      size_t size() const { return _entries.size(); }
+      size_t capacity() const { return _capacity; }
+      size_t hits() const { return _hits; }
+      size_t misses() const { return _misses; }
+    };
+
   };
 
 
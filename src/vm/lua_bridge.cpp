@@ -74,7 +74,11 @@ int line(lua_State* L)
 
 int fillp(lua_State* L)
 {
-  //TODO: implement
+  /* pattern is in integer part while 0x0.8 bit enables transparency */
+  int64_t value = lua_gettop(L) >= 1 ? int64_t(std::floor(lua_tonumber(L, 1) * 65536.0)) : 0;
+
+  machine.fillp(uint16_t(value >> 16), (value & 0x8000) != 0);
+
   return 0;
 }
 
@@ -92,7 +96,6 @@ int rect(lua_State* L)
   return 0;
 }
 
-// TODO: fill pattern on filled shaped
 int rectfill(lua_State* L)
 {
   int x0 = lua_tonumber(L, 1);
@@ -131,6 +134,50 @@ int circfill(lua_State* L)
   return 0;
 }
 
+template<void(Machine::*F)(coord_t, coord_t, coord_t, coord_t, color_t)>
+int oval(lua_State* L)
+{
+  int x0 = lua_tonumber(L, 1);
+  int y0 = lua_tonumber(L, 2);
+  int x1 = lua_tonumber(L, 3);
+  int y1 = lua_tonumber(L, 4);
+  int c = lua_gettop(L) >= 5 ? lua_tonumber(L, 5) : machine.memory().penColor()->low();
+
+  (machine.*F)(x0, y0, x1, y1, color_t(c));
+
+  return 0;
+}
+
+template<void(Machine::*F)(coord_t, coord_t, amount_t, amount_t, amount_t, color_t)>
+int rrect(lua_State* L)
+{
+  int x = lua_tonumber(L, 1);
+  int y = lua_tonumber(L, 2);
+  int w = lua_tonumber(L, 3);
+  int h = lua_tonumber(L, 4);
+  int r = lua_gettop(L) >= 5 ? lua_tonumber(L, 5) : 0;
+  int c = lua_gettop(L) >= 6 ? lua_tonumber(L, 6) : machine.memory().penColor()->low();
+
+  (machine.*F)(x, y, w, h, r, color_t(c));
+
+  return 0;
+}
+
+int trifill(lua_State* L)
+{
+  int x0 = lua_tonumber(L, 1);
+  int y0 = lua_tonumber(L, 2);
+  int x1 = lua_tonumber(L, 3);
+  int y1 = lua_tonumber(L, 4);
+  int x2 = lua_tonumber(L, 5);
+  int y2 = lua_tonumber(L, 6);
+  int c = lua_gettop(L) >= 7 ? lua_tonumber(L, 7) : machine.memory().penColor()->low();
+
+  machine.trifill(x0, y0, x1, y1, x2, y2, color_t(c));
+
+  return 0;
+}
+
 int cls(lua_State* L)
 {
   int c = lua_gettop(L) == 1 ? lua_tonumber(L, -1) : 0;
@@ -171,6 +218,38 @@ int spr(lua_State* L)
   return 0;
 }
 
+/* reads the array part of the table at index 1 without metamethods, an incomplete last group is dropped */
+static const std::vector<coord_t>& readBatch(lua_State* L, size_t stride)
+{
+  std::vector<coord_t>& values = machine.batchEntries();
+
+  const size_t length = lua_istable(L, 1) ? lua_rawlen(L, 1) / stride * stride : 0;
+  values.resize(length);
+
+  for (size_t i = 0; i < length; ++i)
+  {
+    lua_rawgeti(L, 1, i + 1);
+    values[i] = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+  }
+
+  return values;
+}
+
+int sprbatch(lua_State* L)
+{
+  const auto& values = readBatch(L, 3);
+  machine.sprbatch(values.data(), values.size() / 3);
+  return 0;
+}
+
+int psetbatch(lua_State* L)
+{
+  const auto& values = readBatch(L, 3);
+  machine.psetbatch(values.data(), values.size() / 3);
+  return 0;
+}
+
 int sget(lua_State* L)
 {
   int x = lua_tonumber(L, 1);
@@ -187,7 +266,11 @@ int sset(lua_State* L)
   int y = lua_tonumber(L, 2);
   color_t c = lua_gettop(L) >= 3 ? color_t((int)lua_tonumber(L, 3)) : machine.memory().penColor()->low();
 
+  const address_t address = address::SPRITE_SHEET + y * gfx::SPRITE_SHEET_PITCH + x / gfx::PIXEL_TO_BYTE_RATIO;
+
+  machine.memory().sync(address, 1);
   machine.memory().spriteSheet(x, y)->set(x, c);
+  machine.memory().markDirty(address, 1);
 
   return 0;
 }
@@ -200,6 +283,7 @@ int pal(lua_State* L)
   {
     machine.memory().paletteAt(gfx::DRAW_PALETTE_INDEX)->reset();
     machine.memory().paletteAt(gfx::SCREEN_PALETTE_INDEX)->reset();
+    machine.memory().markDirty(address::PALETTES, 2 * sizeof(gfx::palette_t));
   }
   else
   {
@@ -222,6 +306,7 @@ int palt(lua_State* L)
   {
     machine.memory().paletteAt(gfx::DRAW_PALETTE_INDEX)->resetTransparency();
     machine.memory().paletteAt(gfx::SCREEN_PALETTE_INDEX)->resetTransparency();
+    machine.memory().markDirty(address::PALETTES, 2 * sizeof(gfx::palette_t));
   }
   else
   {
@@ -230,6 +315,7 @@ int palt(lua_State* L)
     palette_index_t index = gfx::DRAW_PALETTE_INDEX;
 
     machine.memory().paletteAt(gfx::DRAW_PALETTE_INDEX)->transparent(c, f);
+    machine.memory().markDirty(address::PALETTES, sizeof(gfx::palette_t));
   }
   return 0;
 }
@@ -247,9 +333,11 @@ namespace draw
       uint8_t w = lua_tonumber(L, 3);
       uint8_t h = lua_tonumber(L, 4);
 
-      machine.memory().clipRect()->set(x0, y0, std::min(x0 + w, int32_t(gfx::SCREEN_WIDTH-1)), std::min(y0 + h, int32_t(gfx::SCREEN_HEIGHT-1)));
+      machine.memory().clipRect()->set(x0, y0, std::min(x0 + w, int32_t(gfx::SCREEN_WIDTH)), std::min(y0 + h, int32_t(gfx::SCREEN_HEIGHT)));
     }
 
+    machine.memory().markDirty(address::CLIP_RECT, sizeof(gfx::clip_rect_t));
+
     return 0;
   }
 }
@@ -261,6 +349,7 @@ int camera(lua_State* L)
   int16_t cx = lua_gettop(L) >= 1 ? lua_tonumber(L, 1) : 0;
   int16_t cy = lua_gettop(L) == 2 ? lua_tonumber(L, 2) : 0;
   machine.memory().camera()->set(cx, cy);
+  machine.memory().markDirty(address::CAMERA, sizeof(gfx::camera_t));
 
   return 0;
 }
@@ -283,6 +372,22 @@ int map(lua_State* L)
   return 0;
 }
 
+int tline(lua_State* L)
+{
+  /* map coordinates and deltas are fixed point values in tiles */
+  auto fixed = [L] (int i, real_t def) { return fixed_t(std::floor((lua_gettop(L) >= i ? lua_tonumber(L, i) : def) * 65536.0)); };
+
+  coord_t x0 = lua_tonumber(L, 1);
+  coord_t y0 = lua_tonumber(L, 2);
+  coord_t x1 = lua_tonumber(L, 3);
+  coord_t y1 = lua_tonumber(L, 4);
+  sprite_flags_t layer = lua_gettop(L) >= 9 ? lua_tonumber(L, 9) : 0;
+
+  machine.tline(x0, y0, x1, y1, fixed(5, 0), fixed(6, 0), fixed(7, 0.125f), fixed(8, 0), layer);
+
+  return 0;
+}
+
 int mget(lua_State* L)
 {
   int x = lua_tonumber(L, 1); //TODO: these are optional
@@ -306,7 +411,10 @@ int mset(lua_State* L)
   int y = lua_tonumber(L, 2);
   retro8::sprite_index_t index = lua_tonumber(L, 3);
 
-  *machine.memory().spriteInTileMap(x, y) = index;
+  sprite_index_t* tile = machine.memory().spriteInTileMap(x, y);
+  machine.memory().sync(tile - machine.memory().base(), 1);
+  *tile = index;
+  machine.memory().markDirty(tile - machine.memory().base(), 1);
 
   return 0;
 }
@@ -353,6 +461,7 @@ int cursor(lua_State* L)
     {
       retro8::color_t color = static_cast<retro8::color_t>((int)lua_tonumber(L, 2));
       machine.memory().penColor()->low(color);
+      machine.memory().markDirty(address::PEN_COLOR, sizeof(gfx::color_byte_t));
     }
   }
   else
@@ -404,6 +513,7 @@ namespace sprites
   {
     retro8::sprite_index_t index = lua_tonumber(L, 1);
     retro8::sprite_flags_t* flags = machine.memory().spriteFlagsFor(index);
+    machine.memory().sync(address::SPRITE_FLAGS + index, 1);
 
     if (lua_gettop(L) == 3)
     {
@@ -422,6 +532,8 @@ namespace sprites
       *flags = value;
     }
 
+    machine.memory().markDirty(address::SPRITE_FLAGS + index, 1);
+
     return 0;
   }
 
@@ -435,8 +547,8 @@ namespace sprites
     coord_t dy = lua_tonumber(L, 6);
     coord_t dw = lua_to_or_default(L, number, 7, sw);
     coord_t dh = lua_to_or_default(L, number, 8, sh);
-    bool flipX = lua_to_or_default(L, boolean, 8, false);
-    bool flipY = lua_to_or_default(L, boolean, 8, false);
+    bool flipX = lua_to_or_default(L, boolean, 9, false);
+    bool flipY = lua_to_or_default(L, boolean, 10, false);
 
     machine.sspr(sx, sy, sw, sh, dx, dy, dw, dh, flipX, flipY);
 
@@ -773,7 +885,9 @@ namespace platform
     address_t addr = lua_tonumber(L, 1);
     uint8_t byte = lua_tonumber(L, 2);
 
+    machine.memory().sync(addr, 1);
     machine.memory().base()[addr] = byte;
+    machine.memory().markDirty(addr, 1);
 
     return 0;
   }
@@ -783,8 +897,10 @@ namespace platform
     address_t addr = lua_tonumber(L, 1);
     uint32_t value = lua_tonumber(L, 2);
 
+    machine.memory().sync(addr, 2);
     machine.memory().base()[addr] = value & 0xFF;
     machine.memory().base()[addr+1] = (value & 0xFF00) >> 8;
+    machine.memory().markDirty(addr, 2);
 
     return 0;
   }
@@ -794,10 +910,12 @@ namespace platform
     address_t addr = lua_tonumber(L, 1);
     uint32_t value = lua_tonumber(L, 2);
 
+    machine.memory().sync(addr, 4);
     machine.memory().base()[addr] = value & 0xFF;
     machine.memory().base()[addr + 1] = (value & 0xFF00) >> 8;
     machine.memory().base()[addr + 2] = (value & 0xFF0000) >> 16;
     machine.memory().base()[addr + 3] = (value & 0xFF000000) >> 24;
+    machine.memory().markDirty(addr, 4);
 
     return 0;
   }
@@ -805,6 +923,7 @@ namespace platform
   int peek(lua_State* L)
   {
     address_t addr = lua_tonumber(L, 1);
+    machine.memory().sync(addr, 1);
     uint8_t value = machine.memory().base()[addr];
 
     lua_pushnumber(L, value);
@@ -815,6 +934,7 @@ namespace platform
   int peek2(lua_State* L)
   {
     address_t addr = lua_tonumber(L, 1);
+    machine.memory().sync(addr, 2);
     uint8_t low = machine.memory().base()[addr];
     uint8_t high = machine.memory().base()[addr+1];
 
@@ -826,6 +946,7 @@ namespace platform
   int peek4(lua_State* L)
   {
     address_t addr = lua_tonumber(L, 1);
+    machine.memory().sync(addr, 4);
     uint8_t b1 = machine.memory().base()[addr];
     uint8_t b2 = machine.memory().base()[addr + 1];
     uint8_t b3 = machine.memory().base()[addr + 2];
@@ -843,7 +964,11 @@ namespace platform
     int32_t length = lua_tonumber(L, 3);
 
     if (length > 0)
-      std::memset(machine.memory().base() + addr, 0, length);
+    {
+      machine.memory().sync(addr, length);
+      std::memset(machine.memory().base() + addr, value, length);
+      machine.memory().markDirty(addr, length);
+    }
 
     return 0;
   }
@@ -854,6 +979,9 @@ namespace platform
     address_t src = lua_tonumber(L, 2);
     int32_t length = lua_tonumber(L, 3);
 
+    machine.memory().sync(src, length);
+    machine.memory().sync(dest, length);
+
     //TODO: optimize overlap case?
     if ((src + length < dest) || (dest + length < src))
       std::memcpy(machine.memory().base() + dest, machine.memory().base() + src, length);
@@ -863,6 +991,8 @@ namespace platform
         machine.memory().base()[dest + i] = machine.memory().base()[src + i];
     }
 
+    machine.memory().markDirty(dest, length);
+
     return 0;
   }
 
@@ -871,10 +1001,12 @@ namespace platform
     assert(lua_gettop(L) <= 3);
     
     address_t dest = lua_to_or_default(L, number, 1, 0);
-    address_t src = lua_to_or_default(L, number, 1, 0);
-    int32_t length = lua_to_or_default(L, number, 1, address::CART_DATA_LENGTH);
+    address_t src = lua_to_or_default(L, number, 2, 0);
+    int32_t length = lua_to_or_default(L, number, 3, address::CART_DATA_LENGTH);
     
+    machine.memory().sync(dest, length);
     std::memcpy(machine.memory().base() + dest, machine.memory().backup() + src, length);
+    machine.memory().markDirty(dest, length);
 
     return 0;
   }
@@ -1026,11 +1158,19 @@ void lua::registerFunctions(lua_State* L)
   lua_register(L, "rectfill", rectfill);
   lua_register(L, "circ", circ);
   lua_register(L, "circfill", circfill);
+  lua_register(L, "oval", oval<&Machine::oval>);
+  lua_register(L, "ovalfill", oval<&Machine::ovalfill>);
+  lua_register(L, "rrect", rrect<&Machine::rrect>);
+  lua_register(L, "rrectfill", rrect<&Machine::rrectfill>);
+  lua_register(L, "trifill", trifill);
   lua_register(L, "clip", draw::clip);
   lua_register(L, "cls", cls);
   lua_register(L, "spr", spr);
+  lua_register(L, "sprbatch", sprbatch);
+  lua_register(L, "psetbatch", psetbatch);
   lua_register(L, "camera", camera);
   lua_register(L, "map", map);
+  lua_register(L, "tline", tline);
   lua_register(L, "mget", mget);
   lua_register(L, "mset", mset);
   lua_register(L, "sget", sget);
@@ -1214,7 +1354,10 @@ void Code::update()
 void Code::draw()
 {
   if (_draw)
+  {
     callFunction("_draw");
+    machine.flush();
+  }
 }
 
 void Code::init()
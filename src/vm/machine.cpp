@@ -4,128 +4,327 @@
 
 using namespace retro8;
 
+/* integer divisions rounding towards negative and positive infinity, b must be positive */
+template<typename T> static inline T floorDiv(T a, T b) { return a >= 0 ? a / b : -((-a + b - 1) / b); }
+template<typename T> static inline T ceilDiv(T a, T b) { return -floorDiv<T>(-a, b); }
+
+using command_t = gfx::DrawCommand;
+
+static inline uint8_t flipFlags(bool flipX, bool flipY) { return (flipX ? command_t::FLIP_X : 0) | (flipY ? command_t::FLIP_Y : 0); }
+
 void Machine::color(color_t color)
 {
   gfx::color_byte_t* penColor = _memory.penColor();
   penColor->low(color);
+  _memory.markDirty(address::PEN_COLOR, sizeof(gfx::color_byte_t));
 }
 
-void Machine::cls(color_t color)
+void Machine::fillp(uint16_t pattern, bool transparent)
 {
-  color = _memory.paletteAt(gfx::DRAW_PALETTE_INDEX)->get(color);
-  gfx::color_byte_t value = gfx::color_byte_t(color, color);
-
-  auto* data = _memory.screenData();
-  memset(data, value.value, gfx::BYTES_PER_SCREEN);
+  _memory.fillPattern()->set(pattern, transparent);
+  _memory.markDirty(address::FILL_PATTERN, sizeof(gfx::fill_pattern_t));
+}
 
+void Machine::cls(color_t color)
+{
   _memory.clipRect()->reset();
   *_memory.cursor() = { 0, 0 };
+  _memory.markDirty(address::CLIP_RECT, sizeof(gfx::clip_rect_t));
+
+  const auto& state = drawState();
+  submit(state, { command_t::FILL_RECT, 0, { 0, 0, gfx::SCREEN_WIDTH - 1, gfx::SCREEN_HEIGHT - 1 }, state.color(color) });
+}
+
+static inline void plot(color_t* dest, coord_t x, coord_t y, const gfx::fill_t& fill)
+{
+  if (!fill.alternate(x, y))
+    *dest = fill.primary;
+  else if (!fill.transparent)
+    *dest = fill.secondary;
 }
 
 void Machine::pset(coord_t x, coord_t y, color_t color)
 {
-  auto* clip = _memory.clipRect();
-  x -= memory().camera()->x();
-  y -= memory().camera()->y();
+  const auto& state = drawState();
+  x -= state.cameraX;
+  y -= state.cameraY;
 
-  if (x >= clip->x0 && x < clip->x1 && y >= clip->y0 && y < clip->y1)
-  {
-    color = _memory.paletteAt(gfx::DRAW_PALETTE_INDEX)->get(color_t(color % gfx::COLOR_COUNT));
-    _memory.screenData(x, y)->set(x, color);
-  }
+  submit(state, { command_t::PIXEL, 0, { x, y }, state.fill(color) });
+}
+
+/* entries are (x, y, color) triples drawn with a single draw state as a single command */
+void Machine::psetbatch(const coord_t* entries, size_t count)
+{
+  const auto& state = drawState();
+
+  _batchCommand.clear();
+  for (size_t i = 0; i < count; ++i, entries += 3)
+    _batchCommand.insert(_batchCommand.end(), { entries[0] - state.cameraX, entries[1] - state.cameraY, entries[2] });
+
+  if (!_batchCommand.empty())
+    submit(state, { command_t::PIXELS, 0, { }, gfx::fill_t(), _batchCommand.data(), uint32_t(_batchCommand.size()) });
 }
 
 color_t Machine::pget(coord_t x, coord_t y)
 {
-  return _memory.screenData(x, y)->get(x);
+  if (x < 0 || x >= gfx::SCREEN_WIDTH || y < 0 || y >= gfx::SCREEN_HEIGHT)
+    return color_t::BLACK;
+
+  return _memory.screenPixels()[y * gfx::SCREEN_WIDTH + x];
 }
 
-void Machine::line(coord_t x0, coord_t y0, coord_t x1, coord_t y1, color_t color)
+void Machine::fillSpan(coord_t x0, coord_t x1, coord_t y, color_t color)
 {
-  // vertical
-  if (y0 == y1)
+  memset(_memory.screen(x0, y), color, x1 - x0 + 1);
+}
+
+void Machine::fillSpan(coord_t x0, coord_t x1, coord_t y, const gfx::fill_t& fill)
+{
+  if (fill.solid())
   {
-    if (x0 > x1) std::swap(x0, x1);
+    fillSpan(x0, x1, y, fill.primary);
+    return;
+  }
 
-    for (coord_t x = x0; x <= x1; ++x)
-      pset(x, y0, color);
+  /* pattern repeats every 4 pixels, masks tell which pixels are written, they are cleared for transparent pixels */
+  const uint8_t bits = fill.row(y);
+  uint8_t values[4], masks[4];
+
+  for (coord_t k = 0; k < 4; ++k)
+  {
+    const bool alternate = (bits & (0x08 >> k)) != 0;
+    const bool skip = alternate && fill.transparent;
+
+    values[k] = skip ? 0 : (alternate ? fill.secondary : fill.primary);
+    masks[k] = skip ? 0x00 : 0xff;
   }
-  // horizontal
-  else if (x0 == x1)
+
+  uint8_t* row = reinterpret_cast<uint8_t*>(_memory.screen(0, y));
+  coord_t x = x0;
+
+  /* bulk of the span is written 8 pixels at a time, phase of the pattern is preserved since 8 is a multiple of 4 */
+  uint64_t value = 0, mask = 0;
+  for (coord_t k = 0; k < 8; ++k)
   {
-    if (y0 > y1) std::swap(y0, y1);
+    value |= uint64_t(values[(x + k) & 3]) << (k * 8);
+    mask |= uint64_t(masks[(x + k) & 3]) << (k * 8);
+  }
+
+  for (; x + 8 <= x1 + 1; x += 8)
+  {
+    uint64_t word;
+    std::memcpy(&word, row + x, sizeof(word));
+    word = (word & ~mask) | value;
+    std::memcpy(row + x, &word, sizeof(word));
+  }
+
+  for (; x <= x1; ++x)
+    row[x] = (row[x] & ~masks[x & 3]) | values[x & 3];
+}
+
+void Machine::clipAndFillSpan(const gfx::DrawState& state, coord_t x0, coord_t x1, coord_t y, const gfx::fill_t& fill)
+{
+  if (y < state.clipY0 || y >= state.clipY1)
+    return;
 
+  x0 = std::max(x0, state.clipX0);
+  x1 = std::min(x1, state.clipX1 - 1);
+
+  if (x0 <= x1)
+    fillSpan(x0, x1, y, fill);
+}
+
+void Machine::clipAndFillRect(const gfx::DrawState& state, coord_t x0, coord_t y0, coord_t x1, coord_t y1, const gfx::fill_t& fill)
+{
+  x0 = std::max(x0, state.clipX0);
+  x1 = std::min(x1, state.clipX1 - 1);
+  y0 = std::max(y0, state.clipY0);
+  y1 = std::min(y1, state.clipY1 - 1);
+
+  if (x0 > x1 || y0 > y1)
+    return;
+
+  /* full width rows are contiguous in memory so they can be filled at once */
+  if (fill.solid() && x0 == 0 && x1 == gfx::SCREEN_WIDTH - 1)
+    memset(_memory.screen(0, y0), fill.primary, (y1 - y0 + 1) * gfx::SCREEN_WIDTH);
+  else
+  {
     for (coord_t y = y0; y <= y1; ++y)
-      pset(x0, y, color);
+      fillSpan(x0, x1, y, fill);
+  }
+}
+
+void Machine::clipAndFillColumn(const gfx::DrawState& state, coord_t x, coord_t y0, coord_t y1, const gfx::fill_t& fill)
+{
+  if (x < state.clipX0 || x >= state.clipX1)
+    return;
+
+  y0 = std::max(y0, state.clipY0);
+  y1 = std::min(y1, state.clipY1 - 1);
+
+  if (y0 > y1)
+    return;
+
+  color_t* dest = _memory.screen(x, y0);
+
+  if (!fill.solid())
+  {
+    for (coord_t y = y0; y <= y1; ++y, dest += gfx::SCREEN_WIDTH)
+      plot(dest, x, y, fill);
   }
   else
   {
-    coord_t dx = abs(x1 - x0);
-    coord_t sx = x0 < x1 ? 1 : -1;
-    coord_t dy = -abs(y1 - y0);
-    coord_t sy = y0 < y1 ? 1 : -1;
-    coord_t err = dx + dy;
+    for (coord_t y = y0; y <= y1; ++y, dest += gfx::SCREEN_WIDTH)
+      *dest = fill.primary;
+  }
+}
 
-    while (true)
-    {
-      pset(x0, y0, color);
+void Machine::fillMask(const gfx::DrawState& state, coord_t x, coord_t y, const gfx::text_mask_t& mask, const gfx::fill_t& fill)
+{
+  const coord_t tx0 = std::max<coord_t>(0, state.clipX0 - x), tx1 = std::min(mask.width, state.clipX1 - x);
+  const coord_t ty0 = std::max<coord_t>(0, state.clipY0 - y), ty1 = std::min(mask.height, state.clipY1 - y);
 
-      if (x0 == x1 && y0 == y1)
-        break;
+  for (coord_t ty = ty0; ty < ty1; ++ty)
+  {
+    const uint32_t* row = mask.row(ty);
 
-      coord_t err2 = 2 * err;
+    /* whole empty words are skipped, each run of lit bits is a span */
+    for (coord_t tx = tx0; tx < tx1; )
+    {
+      const uint32_t bits = row[tx / 32] >> (tx % 32);
 
-      if (err2 >= dy)
+      if (!bits)
+        tx = (tx / 32 + 1) * 32;
+      else if (!(bits & 1))
+        ++tx;
+      else
       {
-        err += dy;
-        x0 += sx;
+        const coord_t start = tx;
+        while (tx < tx1 && (row[tx / 32] & (1u << (tx % 32)))) ++tx;
+        fillSpan(x + start, x + tx - 1, y + ty, fill);
       }
+    }
+  }
+}
 
-      if (err2 <= dx)
-      {
-        err += dx;
-        y0 += sy;
-      }
+template<bool X_MAJOR, bool PATTERN>
+static inline void bresenham(color_t* screen, coord_t a, coord_t b, coord_t sa, coord_t sb, int64_t error, int64_t da2, int64_t db2, int64_t count, const gfx::fill_t& fill)
+{
+  for (; count > 0; --count)
+  {
+    const coord_t x = X_MAJOR ? a : b, y = X_MAJOR ? b : a;
+    color_t* dest = screen + y * gfx::SCREEN_WIDTH + x;
+
+    if (PATTERN)
+      plot(dest, x, y, fill);
+    else
+      *dest = fill.primary;
+
+    a += sa;
+    error += db2;
+
+    if (error >= da2)
+    {
+      error -= da2;
+      b += sb;
     }
   }
+}
+
+void Machine::clipAndDrawLine(const gfx::DrawState& state, coord_t x0, coord_t y0, coord_t x1, coord_t y1, const gfx::fill_t& fill)
+{
+  if (y0 == y1)
+  {
+    if (x0 > x1) std::swap(x0, x1);
+    clipAndFillSpan(state, x0, x1, y0, fill);
+    return;
+  }
+  else if (x0 == x1)
+  {
+    if (y0 > y1) std::swap(y0, y1);
+    clipAndFillColumn(state, x0, y0, y1, fill);
+    return;
+  }
+
+  const bool xMajor = std::abs(x1 - x0) >= std::abs(y1 - y0);
+
+  /* step i walks major axis a in [0, da], Bresenham places minor axis b at b0 + sb * floor((2 * i * db + da) / (2 * da))
+     so the range of steps inside clip rect can be computed exactly without altering the rasterized pixels */
+  const coord_t a0 = xMajor ? x0 : y0, b0 = xMajor ? y0 : x0;
+  const coord_t sa = (xMajor ? x1 > x0 : y1 > y0) ? 1 : -1, sb = (xMajor ? y1 > y0 : x1 > x0) ? 1 : -1;
+  const int64_t da = std::abs(xMajor ? x1 - x0 : y1 - y0), db = std::abs(xMajor ? y1 - y0 : x1 - x0);
+
+  const coord_t aMin = xMajor ? state.clipX0 : state.clipY0, aMax = (xMajor ? state.clipX1 : state.clipY1) - 1;
+  const coord_t bMin = xMajor ? state.clipY0 : state.clipX0, bMax = (xMajor ? state.clipY1 : state.clipX1) - 1;
+
+  int64_t i0 = std::max<int64_t>(0, sa > 0 ? aMin - a0 : a0 - aMax);
+  int64_t i1 = std::min<int64_t>(da, sa > 0 ? aMax - a0 : a0 - aMin);
+
+  const int64_t mMin = sb > 0 ? bMin - b0 : b0 - bMax, mMax = sb > 0 ? bMax - b0 : b0 - bMin;
+
+  i0 = std::max(i0, ceilDiv<int64_t>((2 * mMin - 1) * da, 2 * db));
+  i1 = std::min(i1, floorDiv<int64_t>((2 * mMax + 1) * da - 1, 2 * db));
+
+  if (i0 > i1)
+    return;
+
+  const int64_t start = 2 * i0 * db + da;
+  const coord_t a = a0 + sa * i0, b = b0 + sb * coord_t(start / (2 * da));
+  color_t* screen = _memory.screen(0, 0);
+
+  if (xMajor)
+  {
+    if (fill.solid()) bresenham<true, false>(screen, a, b, sa, sb, start % (2 * da), 2 * da, 2 * db, i1 - i0 + 1, fill);
+    else bresenham<true, true>(screen, a, b, sa, sb, start % (2 * da), 2 * da, 2 * db, i1 - i0 + 1, fill);
+  }
+  else
+  {
+    if (fill.solid()) bresenham<false, false>(screen, a, b, sa, sb, start % (2 * da), 2 * da, 2 * db, i1 - i0 + 1, fill);
+    else bresenham<false, true>(screen, a, b, sa, sb, start % (2 * da), 2 * da, 2 * db, i1 - i0 + 1, fill);
+  }
+}
+
+void Machine::line(coord_t x0, coord_t y0, coord_t x1, coord_t y1, color_t color)
+{
+  const auto& state = drawState();
+  submit(state, { command_t::LINE, 0, { x0 - state.cameraX, y0 - state.cameraY, x1 - state.cameraX, y1 - state.cameraY }, state.fill(color) });
 
-  // TODO: shouldn't be updated when invoked from other primitives, eg rect
   _state.lastLineEnd.x = x1;
-  _state.lastLineEnd.x = y1;
+  _state.lastLineEnd.y = y1;
 }
 
 void Machine::rect(coord_t x0, coord_t y0, coord_t x1, coord_t y1, color_t color)
 {
-  line(x0, y0, x1, y0, color);
-  line(x1, y0, x1, y1, color);
-  line(x0, y1, x1, y1, color);
-  line(x0, y1, x0, y0, color);
+  const auto& state = drawState();
+
+  if (x0 > x1) std::swap(x0, x1);
+  if (y0 > y1) std::swap(y0, y1);
+
+  x0 -= state.cameraX;
+  x1 -= state.cameraX;
+  y0 -= state.cameraY;
+  y1 -= state.cameraY;
+
+  const gfx::fill_t fill = state.fill(color);
+
+  submit(state, { command_t::FILL_SPAN, 0, { x0, x1, y0 }, fill });
+  submit(state, { command_t::FILL_SPAN, 0, { x0, x1, y1 }, fill });
+  submit(state, { command_t::FILL_COLUMN, 0, { x0, y0 + 1, y1 - 1 }, fill });
+  submit(state, { command_t::FILL_COLUMN, 0, { x1, y0 + 1, y1 - 1 }, fill });
 }
 
 void Machine::rectfill(coord_t x0, coord_t y0, coord_t x1, coord_t y1, color_t color)
 {
 #if R8_OPTS_ENABLED
 
-  /* compute directly actual bounding box and set the rect without invoking pset */
-
-  auto* clip = _memory.clipRect();
-  auto cx = memory().camera()->x(), cy = memory().camera()->y();
-
-  x0 -= cx;
-  y0 -= cy;
-  x1 -= cx;
-  y1 -= cy;
+  /* compute directly actual bounding box and fill it through the span engine without invoking pset */
 
-  x0 = std::max(x0, coord_t(clip->x0));
-  x1 = std::min(x1, coord_t(clip->x1));
-  y0 = std::max(y0, coord_t(clip->y0));
-  y1 = std::min(y1, coord_t(clip->y1));
+  const auto& state = drawState();
 
-  color = _memory.paletteAt(gfx::DRAW_PALETTE_INDEX)->get(color_t(color % gfx::COLOR_COUNT));
+  if (x0 > x1) std::swap(x0, x1);
+  if (y0 > y1) std::swap(y0, y1);
 
-  for (coord_t y = y0; y <= y1; ++y)
-    for (coord_t x = x0; x <= x1; ++x)
-      _memory.screenData(x, y)->set(x, color);
+  submit(state, { command_t::FILL_RECT, 0, { x0 - state.cameraX, y0 - state.cameraY, x1 - state.cameraX, y1 - state.cameraY }, state.fill(color) });
 #else
   for (coord_t y = y0; y <= y1; ++y)
     for (coord_t x = x0; x <= x1; ++x)
@@ -133,229 +332,1016 @@ void Machine::rectfill(coord_t x0, coord_t y0, coord_t x1, coord_t y1, color_t c
 #endif
 }
 
-void Machine::circHelper(coord_t xc, coord_t yc, coord_t x, coord_t y, color_t color)
+void Machine::fillSymmetricSpans(const gfx::DrawState& state, coord_t x0, coord_t y0, coord_t x1, coord_t y1, const coord_t* halfWidths, amount_t rows, const gfx::fill_t& fill)
 {
-  pset(xc + x, yc + y, color);
-  pset(xc - x, yc + y, color);
-  pset(xc + x, yc - y, color);
-  pset(xc - x, yc - y, color);
-  pset(xc + y, yc + x, color);
-  pset(xc - y, yc + x, color);
-  pset(xc + y, yc - x, color);
-  pset(xc - y, yc - x, color);
+  for (coord_t y = y0; y <= y1; ++y)
+    clipAndFillSpan(state, x0 - halfWidths[0], x1 + halfWidths[0], y, fill);
+
+  for (amount_t dy = 1; dy < rows; ++dy)
+  {
+    clipAndFillSpan(state, x0 - halfWidths[dy], x1 + halfWidths[dy], y0 - dy, fill);
+    clipAndFillSpan(state, x0 - halfWidths[dy], x1 + halfWidths[dy], y1 + dy, fill);
+  }
 }
 
-void Machine::circ(coord_t xc, coord_t yc, amount_t r, color_t color)
+void Machine::strokeSymmetricSpans(const gfx::DrawState& state, coord_t x0, coord_t y0, coord_t x1, coord_t y1, const coord_t* halfWidths, amount_t rows, const gfx::fill_t& fill)
 {
-  //TODO: not identical to pico-8 but acceptable for now
-  coord_t x = 0, y = r;
-  float d = 3 - 2 * r;
-  circHelper(xc, yc, x, y, color);
-
-  while (y >= x)
+  for (amount_t dy = 0; dy < rows; ++dy)
   {
-    x++;
+    /* each row covers from its own half width down to the next row one, outermost row is covered fully */
+    const bool last = dy == rows - 1;
+    const coord_t outer = halfWidths[dy];
+    const coord_t inner = last ? 0 : std::min(outer, halfWidths[dy + 1] + 1);
+
+    const auto stroke = [&](coord_t y) {
+      if (last)
+        clipAndFillSpan(state, x0 - outer, x1 + outer, y, fill);
+      else
+      {
+        clipAndFillSpan(state, x0 - outer, x0 - inner, y, fill);
+        clipAndFillSpan(state, x1 + inner, x1 + outer, y, fill);
+      }
+    };
 
-    if (d > 0)
+    if (dy == 0)
     {
-      y--;
-      d = d + 4 * (x - y) + 5;
+      for (coord_t y = y0; y <= y1; ++y)
+        stroke(y);
     }
     else
-      d = d + 4 * x + 3;
+    {
+      stroke(y0 - dy);
+      stroke(y1 + dy);
+    }
+  }
+}
+
+void Machine::circ(coord_t xc, coord_t yc, amount_t r, color_t color)
+{
+  if (r < 0 || r > gfx::CircleSpanCache::MAX_RADIUS)
+    return;
+
+  const auto& state = drawState();
+  xc -= state.cameraX;
+  yc -= state.cameraY;
+
+  submit(state, { command_t::STROKE_SYMMETRIC, 0, { xc, yc, xc, yc }, state.fill(color), _circles.halfWidths(r).data(), uint32_t(r + 1) });
+}
+
+void Machine::circfill(coord_t xc, coord_t yc, amount_t r, color_t color)
+{
+  if (r < 0 || r > gfx::CircleSpanCache::MAX_RADIUS)
+    return;
+
+  const auto& state = drawState();
+  xc -= state.cameraX;
+  yc -= state.cameraY;
+
+  submit(state, { command_t::FILL_SYMMETRIC, 0, { xc, yc, xc, yc }, state.fill(color), _circles.halfWidths(r).data(), uint32_t(r + 1) });
+}
+
+void Machine::oval(coord_t x0, coord_t y0, coord_t x1, coord_t y1, color_t color)
+{
+  const auto& state = drawState();
 
-    circHelper(xc, yc, x, y, color);
+  if (x0 > x1) std::swap(x0, x1);
+  if (y0 > y1) std::swap(y0, y1);
+
+  /* semi axes over the limit are rejected, as for circles */
+  if (int64_t(x1) - x0 > 2 * gfx::CircleSpanCache::MAX_RADIUS + 1 || int64_t(y1) - y0 > 2 * gfx::CircleSpanCache::MAX_RADIUS + 1)
+    return;
+
+  const amount_t w = x1 - x0, h = y1 - y0;
+  x0 -= state.cameraX;
+  y0 -= state.cameraY;
+
+  submit(state, { command_t::STROKE_SYMMETRIC, 0, { x0 + w / 2, y0 + h / 2, x0 + w - w / 2, y0 + h - h / 2 }, state.fill(color), _circles.ovalHalfWidths(w, h).data(), uint32_t(h / 2 + 1) });
+}
+
+void Machine::ovalfill(coord_t x0, coord_t y0, coord_t x1, coord_t y1, color_t color)
+{
+  const auto& state = drawState();
+
+  if (x0 > x1) std::swap(x0, x1);
+  if (y0 > y1) std::swap(y0, y1);
+
+  /* semi axes over the limit are rejected, as for circles */
+  if (int64_t(x1) - x0 > 2 * gfx::CircleSpanCache::MAX_RADIUS + 1 || int64_t(y1) - y0 > 2 * gfx::CircleSpanCache::MAX_RADIUS + 1)
+    return;
+
+  const amount_t w = x1 - x0, h = y1 - y0;
+  x0 -= state.cameraX;
+  y0 -= state.cameraY;
+
+  submit(state, { command_t::FILL_SYMMETRIC, 0, { x0 + w / 2, y0 + h / 2, x0 + w - w / 2, y0 + h - h / 2 }, state.fill(color), _circles.ovalHalfWidths(w, h).data(), uint32_t(h / 2 + 1) });
+}
+
+/* a rounded rect is a box with corners made by the rows of a circle, radius is limited by shorter side */
+void Machine::rrect(coord_t x, coord_t y, amount_t w, amount_t h, amount_t r, color_t color)
+{
+  if (w <= 0 || h <= 0)
+    return;
+
+  r = std::max(0, std::min(r, (std::min(w, h) - 1) / 2));
+
+  if (r == 0)
+  {
+    rect(x, y, x + w - 1, y + h - 1, color);
+    return;
   }
+
+  const auto& state = drawState();
+  x -= state.cameraX;
+  y -= state.cameraY;
+
+  submit(state, { command_t::STROKE_SYMMETRIC, 0, { x + r, y + r, x + w - 1 - r, y + h - 1 - r }, state.fill(color), _circles.halfWidths(r).data(), uint32_t(r + 1) });
+}
+
+void Machine::rrectfill(coord_t x, coord_t y, amount_t w, amount_t h, amount_t r, color_t color)
+{
+  if (w <= 0 || h <= 0)
+    return;
+
+  r = std::max(0, std::min(r, (std::min(w, h) - 1) / 2));
+
+  const auto& state = drawState();
+  x -= state.cameraX;
+  y -= state.cameraY;
+
+  submit(state, { command_t::FILL_SYMMETRIC, 0, { x + r, y + r, x + w - 1 - r, y + h - 1 - r }, state.fill(color), _circles.halfWidths(r).data(), uint32_t(r + 1) });
 }
 
-void Machine::circFillHelper(coord_t xc, coord_t yc, coord_t x, coord_t y, color_t col)
+/* x of an edge at row y rounded to nearest pixel */
+static inline coord_t edgeX(coord_t xa, coord_t ya, coord_t xb, coord_t yb, coord_t y)
 {
-  //TODO: totally inefficient
-  rectfill(xc - x, yc - y, xc + x, yc + y, col);
-  rectfill(xc - y, yc - x, xc + y, yc + x, col);
+  if (ya == yb)
+    return xa;
+
+  const int64_t num = 2 * int64_t(xb - xa) * (y - ya) + (yb - ya);
+  const int64_t den = 2 * int64_t(yb - ya);
+  return xa + coord_t(num >= 0 ? num / den : -((-num + den - 1) / den));
 }
 
+void Machine::trifill(coord_t x0, coord_t y0, coord_t x1, coord_t y1, coord_t x2, coord_t y2, color_t color)
+{
+  const auto& state = drawState();
 
-void Machine::circfill(coord_t xc, coord_t yc, amount_t r, color_t color)
+  x0 -= state.cameraX; x1 -= state.cameraX; x2 -= state.cameraX;
+  y0 -= state.cameraY; y1 -= state.cameraY; y2 -= state.cameraY;
+
+  submit(state, { command_t::FILL_TRIANGLE, 0, { x0, y0, x1, y1, x2, y2 }, state.fill(color) });
+}
+
+void Machine::fillTriangle(const gfx::DrawState& state, coord_t x0, coord_t y0, coord_t x1, coord_t y1, coord_t x2, coord_t y2, const gfx::fill_t& fill)
 {
-  //TODO: not identical to pico-8 but acceptable for now
-  coord_t x = 0, y = r;
-  float d = 3 - 2 * r;
-  circFillHelper(xc, yc, x, y, color);
+  /* sort vertices by y so that long edge goes from 0 to 2 and the other two meet at 1 */
+  if (y0 > y1) { std::swap(x0, x1); std::swap(y0, y1); }
+  if (y1 > y2) { std::swap(x1, x2); std::swap(y1, y2); }
+  if (y0 > y1) { std::swap(x0, x1); std::swap(y0, y1); }
 
-  int ctr = 0;
-  while (y >= x)
+  const coord_t top = std::max(y0, state.clipY0), bottom = std::min(y2, state.clipY1 - 1);
+
+  for (coord_t y = top; y <= bottom; ++y)
   {
-    x++;
+    const coord_t xl = edgeX(x0, y0, x2, y2, y);
+    const coord_t xs = y < y1 ? edgeX(x0, y0, x1, y1, y) : edgeX(x1, y1, x2, y2, y);
+
+    coord_t xa = std::min(xl, xs), xb = std::max(xl, xs);
 
-    if (d > 0)
+    /* vertices on flat edges can stick out of the row */
+    if (y == y1)
     {
-      y--;
-      d = d + 3 * (x - y) + 5;
+      xa = std::min(xa, x1);
+      xb = std::max(xb, x1);
+    }
+
+    if (y == y2)
+    {
+      xa = std::min(xa, x2);
+      xb = std::max(xb, x2);
     }
-    else
-      d = d + 3 * x + 3;
 
-    circFillHelper(xc, yc, x, y, color);
+    clipAndFillSpan(state, xa, xb, y, fill);
   }
 }
 
-void Machine::spr(index_t idx, coord_t x, coord_t y)
+template<bool FLIP_X, bool OPAQUE>
+static inline void blitSpriteRow(const color_t* src, color_t* dest, coord_t x0, coord_t x1, coord_t x, coord_t w, const color_t* remap, uint16_t transparent)
 {
-  const gfx::sprite_t* sprite = _memory.spriteAt(idx);
-  const gfx::palette_t* palette = _memory.paletteAt(gfx::DRAW_PALETTE_INDEX);
+  for (coord_t dx = x0; dx < x1; ++dx)
+  {
+    const color_t color = src[FLIP_X ? (w - (dx - x) - 1) : (dx - x)];
 
-  for (coord_t ty = 0; ty < gfx::SPRITE_HEIGHT; ++ty)
-    for (coord_t tx = 0; tx < gfx::SPRITE_WIDTH; ++tx)
-    {
-      color_t color = sprite->get(tx, ty);
-      if (!palette->transparent(color))
-        pset(x + tx, y + ty, color);
-    }
+    if (OPAQUE || !(transparent & (1 << color)))
+      dest[dx] = remap[color];
+  }
+}
+
+/* restricts a source range [s, s + length) to [0, size), adjusting the destination
+   start d accordingly, if destination is flipped the opposite side is moved */
+template<bool FLIP>
+static inline void clipSource(coord_t& s, coord_t& d, coord_t& length, coord_t size)
+{
+  if (s < 0)
+  {
+    if (!FLIP) d -= s;
+    length += s;
+    s = 0;
+  }
+
+  if (s + length > size)
+  {
+    if (FLIP) d += s + length - size;
+    length = size - s;
+  }
 }
 
-void Machine::spr(index_t idx, coord_t bx, coord_t by, float sw, float sh, bool flipX, bool flipY)
+template<bool FLIP_X, bool FLIP_Y>
+void Machine::blitSprite(const gfx::DrawState& state, coord_t sx, coord_t sy, coord_t x, coord_t y, coord_t w, coord_t h)
 {
-  const gfx::palette_t* palette = _memory.paletteAt(gfx::DRAW_PALETTE_INDEX);
+  const gfx::SpriteSheetCache& sheet = spriteSheet();
 
-  coord_t w = sw * gfx::SPRITE_WIDTH;
-  coord_t h = sh * gfx::SPRITE_HEIGHT;
+  /* texels outside of sprite sheet are never drawn */
+  clipSource<FLIP_X>(sx, x, w, gfx::SPRITE_SHEET_WIDTH);
+  clipSource<FLIP_Y>(sy, y, h, gfx::SPRITE_SHEET_HEIGHT);
 
-  /* we bypass spriteAt since we can use directly the address */
-  const gfx::color_byte_t* base = reinterpret_cast<const gfx::color_byte_t*>(_memory.spriteAt(idx));
+  /* intersect sprite rect with clip rect once */
+  const coord_t x0 = std::max(x, state.clipX0), x1 = std::min(x + w, state.clipX1);
+  const coord_t y0 = std::max(y, state.clipY0), y1 = std::min(y + h, state.clipY1);
 
-  for (coord_t y = 0; y < h; ++y)
+  if (x0 >= x1 || y0 >= y1)
+    return;
+
+  const color_t* remap = state.remap.data();
+  const uint16_t transparent = state.transparent;
+
+  for (coord_t dy = y0; dy < y1; ++dy)
   {
-    for (coord_t x = 0; x < w; ++x)
-    {
-      coord_t fx = flipX ? (w - x - 1) : x;
-      coord_t fy = flipY ? (h - y - 1) : y;
+    const coord_t ty = sy + (FLIP_Y ? (h - (dy - y) - 1) : (dy - y));
+    const auto colors = sheet.rowColors(sx, ty, w);
 
-      //TODO: optimize by fetching only once if we need to read next pixel?
-      const gfx::color_byte_t pair = *(base + y * gfx::SPRITE_SHEET_PITCH + x / gfx::PIXEL_TO_BYTE_RATIO);
-      const color_t color = pair.get(x);
+    /* fully transparent row */
+    if (!(colors & ~transparent))
+      continue;
 
-      if (!palette->transparent(color))
-        pset(bx + fx, by + fy, color);
-    }
+    const color_t* src = sheet.row(sx, ty);
+    color_t* dest = _memory.screen(0, dy);
+
+    if (!(colors & transparent))
+      blitSpriteRow<FLIP_X, true>(src, dest, x0, x1, x, w, remap, transparent);
+    else
+      blitSpriteRow<FLIP_X, false>(src, dest, x0, x1, x, w, remap, transparent);
   }
 }
 
-void Machine::sspr(coord_t sx, coord_t sy, coord_t sw, coord_t sh, coord_t dx, coord_t dy, coord_t dw, coord_t dh, bool flipX, bool flipY)
+/* exact integer DDA which walks value = floor(i * num / den) one step of i at a time */
+struct dda_t
 {
-  const gfx::palette_t* palette = _memory.paletteAt(gfx::DRAW_PALETTE_INDEX);
+  coord_t value, error;
+  const coord_t step, fraction, den;
+
+  dda_t(coord_t i, coord_t num, coord_t den) : value(coord_t(int64_t(i) * num / den)), error(coord_t(int64_t(i) * num % den)), step(num / den), fraction(num % den), den(den) { }
 
-  float fx = sx, fy = sy;
-  float xr = sw / float(dw);
-  float yr = sh / float(dh);
+  inline void next() { value += step; error += fraction; if (error >= den) { error -= den; ++value; } }
+  inline void prev() { value -= step; error -= fraction; if (error < 0) { error += den; --value; } }
+};
+
+template<bool FLIP_X, bool FLIP_Y>
+void Machine::stretchSprite(const gfx::DrawState& state, coord_t sx, coord_t sy, coord_t sw, coord_t sh, coord_t x, coord_t y, coord_t w, coord_t h)
+{
+  const gfx::SpriteSheetCache& sheet = spriteSheet();
 
-  //TODO: flipx flipy, test ratio calculation
+  coord_t x0 = std::max(x, state.clipX0), x1 = std::min(x + w, state.clipX1);
+  coord_t y0 = std::max(y, state.clipY0), y1 = std::min(y + h, state.clipY1);
 
-  for (coord_t y = 0; y < dh; ++y)
+  if (x0 >= x1 || y0 >= y1)
+    return;
+
+  const color_t* remap = state.remap.data();
+  const uint16_t transparent = state.transparent;
+
+  /* integer ratio: every texel becomes a kx * ky block of pixels, so the visible part of each source row
+     is expanded once and copied to the ky destination rows it covers */
+  if (w % sw == 0 && h % sh == 0)
   {
-    for (coord_t x = 0; x < dw; ++x)
+    const coord_t kx = w / sw, ky = h / sh;
+    std::array<color_t, gfx::SCREEN_WIDTH> expanded;
+    std::array<bool, gfx::SCREEN_WIDTH> opaque;
+
+    for (coord_t dy = y0; dy < y1; )
     {
-      coord_t cx = fx, cy = fy;
-      auto pair = _memory.spriteSheet(cx, cy);
-      auto color = pair->get(cx);
+      const coord_t j = FLIP_Y ? (h - (dy - y) - 1) : (dy - y);
+      const coord_t ty = sy + j / ky;
+      const coord_t end = std::min(y1, dy + (FLIP_Y ? j % ky + 1 : ky - j % ky));
+
+      if (ty < 0 || ty >= coord_t(gfx::SPRITE_SHEET_HEIGHT))
+      {
+        dy = end;
+        continue;
+      }
+
+      const color_t* src = sheet.row(0, ty);
+      bool solid = true, empty = true;
+
+      for (coord_t cell = (x0 - x) / kx; cell <= (x1 - 1 - x) / kx; ++cell)
+      {
+        const coord_t tx = sx + (FLIP_X ? sw - cell - 1 : cell);
+        const bool visible = tx >= 0 && tx < coord_t(gfx::SPRITE_SHEET_WIDTH) && !(transparent & (1 << src[tx]));
+        const coord_t c0 = std::max(x + cell * kx, x0) - x0, c1 = std::min(x + (cell + 1) * kx, x1) - x0;
+
+        std::fill(opaque.begin() + c0, opaque.begin() + c1, visible);
+        if (visible)
+          std::fill(expanded.begin() + c0, expanded.begin() + c1, remap[src[tx]]);
 
-      if (!palette->transparent(color))
-        pset(dx + x, dy + y, color);
+        solid &= visible;
+        empty &= !visible;
+      }
+
+      for (; dy < end; ++dy)
+      {
+        color_t* dest = _memory.screen(x0, dy);
 
-      fx += xr;
+        if (solid)
+          std::copy(expanded.begin(), expanded.begin() + (x1 - x0), dest);
+        else if (!empty)
+        {
+          for (coord_t dx = 0; dx < x1 - x0; ++dx)
+            if (opaque[dx]) dest[dx] = expanded[dx];
+        }
+      }
     }
 
-    fx = sx;
-    fy += yr;
+    return;
+  }
+
+  /* precompute source column of every visible destination pixel */
+  std::array<coord_t, gfx::SCREEN_WIDTH> columns;
+  const coord_t* column = columns.data();
+
+  {
+    dda_t tx(FLIP_X ? (w - (x0 - x) - 1) : (x0 - x), sw, w);
+
+    for (coord_t dx = x0; dx < x1; ++dx)
+    {
+      columns[dx - x0] = sx + tx.value;
+      if (FLIP_X) tx.prev(); else tx.next();
+    }
+
+    /* texels outside of sprite sheet are never drawn, mapping is monotonic so they can be trimmed at both ends */
+    const auto inside = [](coord_t tx) { return tx >= 0 && tx < coord_t(gfx::SPRITE_SHEET_WIDTH); };
+
+    coord_t first = 0, last = x1 - x0;
+    while (first < last && !inside(columns[first])) ++first;
+    while (last > first && !inside(columns[last - 1])) --last;
+
+    column += first;
+    x1 = x0 + last;
+    x0 = x0 + first;
+  }
+
+  dda_t row(FLIP_Y ? (h - (y0 - y) - 1) : (y0 - y), sh, h);
+
+  for (coord_t dy = y0; dy < y1; ++dy)
+  {
+    const coord_t ty = sy + row.value;
+    if (FLIP_Y) row.prev(); else row.next();
+
+    if (ty < 0 || ty >= coord_t(gfx::SPRITE_SHEET_HEIGHT))
+      continue;
+
+    const color_t* src = sheet.row(0, ty);
+    color_t* dest = _memory.screen(0, dy);
+
+    for (coord_t dx = x0; dx < x1; ++dx)
+    {
+      const color_t color = src[column[dx - x0]];
+
+      if (!(transparent & (1 << color)))
+        dest[dx] = remap[color];
+    }
   }
 }
 
-// TODO: add support for strange characters like symbols
-void Machine::print(const std::string& string, coord_t x, coord_t y, color_t color)
+template<bool FLIP_X, bool FLIP_Y>
+void Machine::blitCell(const gfx::DrawState& state, sprite_index_t index, coord_t x, coord_t y)
 {
-  
-  struct SpecialGlyph
+  const auto& bounds = spriteSheet().bounds(index, state.transparent);
+
+  if (bounds.empty())
+    return;
+
+  /* only opaque bounds are blitted, when flipped they are mirrored inside the cell */
+  const coord_t sx = (index % gfx::SPRITES_PER_SPRITE_SHEET_ROW) * gfx::SPRITE_WIDTH;
+  const coord_t sy = (index / gfx::SPRITES_PER_SPRITE_SHEET_ROW) * gfx::SPRITE_HEIGHT;
+  const coord_t dx = FLIP_X ? gfx::SPRITE_WIDTH - bounds.x1 : bounds.x0;
+  const coord_t dy = FLIP_Y ? gfx::SPRITE_HEIGHT - bounds.y1 : bounds.y0;
+
+  submit(state, { command_t::BLIT_SPRITE, flipFlags(FLIP_X, FLIP_Y), { sx + bounds.x0, sy + bounds.y0, x + dx, y + dy, bounds.x1 - bounds.x0, bounds.y1 - bounds.y0 } });
+}
+
+void Machine::spr(index_t idx, coord_t x, coord_t y)
+{
+  const auto& state = drawState();
+
+  blitCell<false, false>(state, sprite_index_t(idx), x - state.cameraX, y - state.cameraY);
+}
+
+/* entries are (index, x, y) triples drawn with a single draw state, opaque bounds of each cell are
+   resolved here as in blitCell and blitted by a single command */
+void Machine::sprbatch(const coord_t* entries, size_t count)
+{
+  const auto& state = drawState();
+  auto& sheet = spriteSheet();
+
+  _batchCommand.clear();
+  for (size_t i = 0; i < count; ++i, entries += 3)
   {
-    std::vector<uint8_t> encoding;
-    size_t index;
-  };
+    const sprite_index_t index = sprite_index_t(entries[0]);
+    const auto& bounds = sheet.bounds(index, state.transparent);
+
+    if (bounds.empty())
+      continue;
+
+    const coord_t sx = (index % gfx::SPRITES_PER_SPRITE_SHEET_ROW) * gfx::SPRITE_WIDTH;
+    const coord_t sy = (index / gfx::SPRITES_PER_SPRITE_SHEET_ROW) * gfx::SPRITE_HEIGHT;
+
+    _batchCommand.insert(_batchCommand.end(), { sx + bounds.x0, sy + bounds.y0, entries[1] - state.cameraX + bounds.x0, entries[2] - state.cameraY + bounds.y0, bounds.x1 - bounds.x0, bounds.y1 - bounds.y0 });
+  }
+
+  if (!_batchCommand.empty())
+    submit(state, { command_t::BLIT_SPRITES, 0, { }, gfx::fill_t(), _batchCommand.data(), uint32_t(_batchCommand.size()) });
+}
+
+void Machine::spr(index_t idx, coord_t x, coord_t y, float sw, float sh, bool flipX, bool flipY)
+{
+  const auto& state = drawState();
+
+  const coord_t sx = (idx % gfx::SPRITES_PER_SPRITE_SHEET_ROW) * gfx::SPRITE_WIDTH;
+  const coord_t sy = ((idx / gfx::SPRITES_PER_SPRITE_SHEET_ROW) % gfx::SPRITES_PER_SPRITE_SHEET_ROW) * gfx::SPRITE_HEIGHT;
+  const coord_t w = sw * gfx::SPRITE_WIDTH;
+  const coord_t h = sh * gfx::SPRITE_HEIGHT;
+
+  x -= state.cameraX;
+  y -= state.cameraY;
+
+  if (w == gfx::SPRITE_WIDTH && h == gfx::SPRITE_HEIGHT)
+  {
+    if (flipX && flipY)
+      blitCell<true, true>(state, sprite_index_t(idx), x, y);
+    else if (flipX)
+      blitCell<true, false>(state, sprite_index_t(idx), x, y);
+    else if (flipY)
+      blitCell<false, true>(state, sprite_index_t(idx), x, y);
+    else
+      blitCell<false, false>(state, sprite_index_t(idx), x, y);
+  }
+  else
+    submit(state, { command_t::BLIT_SPRITE, flipFlags(flipX, flipY), { sx, sy, x, y, w, h } });
+}
+
+void Machine::sspr(coord_t sx, coord_t sy, coord_t sw, coord_t sh, coord_t dx, coord_t dy, coord_t dw, coord_t dh, bool flipX, bool flipY)
+{
+  if (sw <= 0 || sh <= 0 || dw <= 0 || dh <= 0)
+    return;
+
+  const auto& state = drawState();
+
+  dx -= state.cameraX;
+  dy -= state.cameraY;
+
+  /* 1:1 ratio is just a plain sprite blit */
+  if (sw == dw && sh == dh)
+    submit(state, { command_t::BLIT_SPRITE, flipFlags(flipX, flipY), { sx, sy, dx, dy, dw, dh } });
+  else
+    submit(state, { command_t::STRETCH_SPRITE, flipFlags(flipX, flipY), { sx, sy, sw, sh, dx, dy, dw, dh } });
+}
+
+void Machine::print(const std::string& string, coord_t x, coord_t y, color_t color)
+{
+  const auto& state = drawState();
+  const gfx::fill_t fill = state.fill(color);
+
+  x -= state.cameraX;
+  y -= state.cameraY;
 
-  static const std::array<SpecialGlyph, 12> SpecialGlyphs = { {
-    { { 0xe2, 0xac, 0x87, 0xef, 0xb8, 0x8f }, 3 }, // down arrow
-    { { 0xe2, 0xac, 0x86, 0xef, 0xb8, 0x8f }, 20}, // up arrow
-    { { 0xe2, 0xac, 0x85, 0xef, 0xb8, 0x8f }, 11}, // left arrow
-    { { 0xe2, 0x9e, 0xa1, 0xef, 0xb8, 0x8f }, 17}, // right arrow
-    { { 0xf0, 0x9f, 0x85, 0xbe, 0xef, 0xb8, 0x8f }, 14 }, // o button
-    { { 0xe2, 0x9d, 0x8e }, 23 }, // x button
+  /* recorded commands point into the cache so they must be executed before a string is evicted */
+  if (deferred() && _textRuns.size() >= _textRuns.capacity() && !_textRuns.contains(string))
+    flush();
 
-    // 0x8b left, 0x91 right, 0x94 up, 0x83 down, 0x83 o, 0x97 x
-    { { 0x8b }, 11 }, { { 0x91, }, 17 }, { { 0x94 }, 20 }, { { 0x83 }, 3 }, { { 0x8e }, 14 }, { { 0x97 }, 23 } 
-  } };
+  const auto& run = _textRuns.get(_font, string);
 
-  static const std::array<uint8_t, 2> Prefixes = { 0xe2, 0xf0 };
+  if (!run.empty())
+    submit(state, { command_t::FILL_MASK, 0, { x, y }, fill, nullptr, 0, &run });
+}
+
+void Machine::pal(color_t c0, color_t c1, palette_index_t index)
+{
+  gfx::palette_t* palette = _memory.paletteAt(index);
+  palette->set(c0, c1);
+  _memory.markDirty(address::PALETTES + index * sizeof(gfx::palette_t) + c0, 1);
+}
 
-  const coord_t sx = x;
-  for (size_t i = 0; i < string.length(); ++i)
+
+void Machine::refreshMapLayer(const gfx::DrawState& state, gfx::MapLayerCache::layer_t& layer)
+{
+  const auto& sheet = spriteSheet();
+  const uint8_t* sheetData = reinterpret_cast<const uint8_t*>(_memory.spriteSheet());
+  const sprite_flags_t* flags = _memory.spriteFlagsFor(0);
+  const coord_t w = layer.x1 - layer.x0, h = layer.y1 - layer.y0;
+
+  /* palette changes affect every tile, otherwise only tiles which changed or which use a sprite which changed are rendered again */
+  const bool all = !layer.valid || layer.remap != state.remap || layer.transparent != state.transparent;
+  const bool sheetChanged = layer.sheetGeneration != _memory.spriteSheetGeneration();
+  const bool mapChanged = layer.mapGeneration != _memory.mapGeneration();
+  std::array<bool, gfx::SPRITE_COUNT> changed = { };
+
+  /* nothing the region depends on has been written since it was rendered */
+  if (!all && !sheetChanged && !mapChanged)
+    return;
+
+  if (all)
   {
-    auto c = string[i];
+    layer.tiles.assign(w * h, 0);
+    layer.pixels.assign(layer.width() * layer.height(), gfx::MapLayerCache::HOLE);
+    layer.runs.assign(layer.height(), std::vector<gfx::MapLayerCache::run_t>());
+  }
+  else
+  {
+    if (sheetChanged)
+    {
+      for (size_t i = 0; i < gfx::SPRITE_COUNT; ++i)
+      {
+        const size_t base = (i / gfx::SPRITES_PER_SPRITE_SHEET_ROW) * gfx::SPRITE_HEIGHT * gfx::SPRITE_SHEET_PITCH + (i % gfx::SPRITES_PER_SPRITE_SHEET_ROW) * gfx::SPRITE_BYTES_PER_SPRITE_ROW;
 
-    if (c == '\n')
+        for (size_t r = 0; r < gfx::SPRITE_HEIGHT && !changed[i]; ++r)
+          changed[i] = memcmp(sheetData + base + r * gfx::SPRITE_SHEET_PITCH, layer.sheetData.data() + base + r * gfx::SPRITE_SHEET_PITCH, gfx::SPRITE_BYTES_PER_SPRITE_ROW) != 0;
+      }
+    }
+
+    if (mapChanged && layer.mask)
     {
-      y += TEXT_LINE_HEIGHT;
-      x = sx;
-      continue;
+      for (size_t i = 0; i < gfx::SPRITE_COUNT; ++i)
+        changed[i] = changed[i] || ((flags[i] & layer.mask) != 0) != ((layer.flags[i] & layer.mask) != 0);
     }
+  }
+
+  layer.valid = true;
+  layer.sheetGeneration = _memory.spriteSheetGeneration();
+  layer.mapGeneration = _memory.mapGeneration();
+  layer.remap = state.remap;
+  layer.transparent = state.transparent;
+  if (all || sheetChanged)
+    std::copy(sheetData, sheetData + layer.sheetData.size(), layer.sheetData.begin());
+  if (all || mapChanged)
+    std::copy(flags, flags + layer.flags.size(), layer.flags.begin());
+
+  /* with only sprite sheet changed tile indices are the same so only tiles using changed sprites are found */
+  for (coord_t ty = 0; ty < h; ++ty)
+  {
+    const sprite_index_t* row = _memory.spriteInTileMap(0, layer.y0 + ty);
+    bool dirty = false;
 
-    auto specialGlyph = std::find_if(SpecialGlyphs.begin(), SpecialGlyphs.end(), [&string, &i](const SpecialGlyph& glyph) {
-      return string.size() >= i + glyph.encoding.size() && memcmp(&string[i], &glyph.encoding[0], glyph.encoding.size()) == 0; //TODO: memcmp is not best design ever
-    });
+    for (coord_t tx = 0; tx < w; ++tx)
+    {
+      const sprite_index_t index = row[layer.x0 + tx];
+      sprite_index_t& cached = layer.tiles[ty * w + tx];
 
-    const gfx::sequential_sprite_t* sprite = nullptr;
-    coord_t width = gfx::GLYPH_WIDTH;
+      if (all || index != cached || changed[index])
+      {
+        cached = index;
+        layer.renderTile(tx, ty, index, index != 0 && (!layer.mask || (layer.mask & flags[index]) != 0), sheet);
+        dirty = true;
+      }
+    }
 
-    if (specialGlyph != SpecialGlyphs.end())
+    if (dirty)
     {
-      sprite = _font.specialGlyph(specialGlyph->index);
-      width = 8;
-      i += specialGlyph->encoding.size() - 1;
+      for (coord_t y = 0; y < coord_t(gfx::SPRITE_HEIGHT); ++y)
+        layer.computeRuns(ty * gfx::SPRITE_HEIGHT + y);
     }
-    else
-      sprite = _font.glyph(c);
+  }
+}
 
-    if (sprite)
+void Machine::map(coord_t cx, coord_t cy, coord_t x, coord_t y, amount_t cw, amount_t ch, sprite_flags_t layer)
+{
+  const auto& state = drawState();
+
+  x -= state.cameraX;
+  y -= state.cameraY;
+
+  /* cached layers change while commands are recorded so they're used only when drawing immediately */
+  if (_mapCache && !deferred())
+  {
+    /* large regions are pre-rendered once and then drawn by copying their runs of drawn pixels */
+    const coord_t mx0 = std::max(cx, 0), mx1 = std::min(cx + cw, coord_t(gfx::TILE_MAP_WIDTH));
+    const coord_t my0 = std::max(cy, 0), my1 = std::min(cy + ch, coord_t(gfx::TILE_MAP_HEIGHT));
+
+    if (mx0 < mx1 && my0 < my1 && (mx1 - mx0) * (my1 - my0) >= gfx::MapLayerCache::MIN_CACHED_TILES)
     {
-      for (coord_t ty = 0; ty < gfx::GLYPH_HEIGHT; ++ty)
-        for (coord_t tx = 0; tx < width; ++tx)
+      auto& cached = _mapLayers.get(mx0, my0, mx1, my1, layer);
+
+      if (cached.requested)
+      {
+        refreshMapLayer(state, cached);
+
+        const coord_t ox = x + (mx0 - cx) * gfx::SPRITE_WIDTH, oy = y + (my0 - cy) * gfx::SPRITE_HEIGHT;
+        const coord_t r0 = std::max(0, state.clipY0 - oy), r1 = std::min(cached.height(), state.clipY1 - oy);
+        _memory.markRowsDirty(oy + r0, oy + r1 - 1);
+
+        for (coord_t r = r0; r < r1; ++r)
         {
-          color_t fcolor = sprite->get(tx, ty);
-          if (fcolor != 0)
-            pset(x + tx, y + ty, color);
+          const color_t* src = &cached.pixels[r * cached.width()];
+          const auto& runs = cached.runs[r];
+
+          /* runs are sorted so the first one ending inside clip rect can be searched */
+          auto it = std::lower_bound(runs.begin(), runs.end(), state.clipX0 - ox + 1, [] (const gfx::MapLayerCache::run_t& run, coord_t x) { return run.x1 < x; });
+
+          for (; it != runs.end() && it->x0 + ox < state.clipX1; ++it)
+          {
+            const coord_t dx0 = std::max(it->x0 + ox, state.clipX0), dx1 = std::min(it->x1 + ox, state.clipX1);
+            memcpy(_memory.screen(dx0, oy + r), src + dx0 - ox, dx1 - dx0);
+          }
         }
 
-      x += width;
+        return;
+      }
+
+      cached.requested = true;
+    }
+  }
+
+  /* restrict drawing to tiles which are inside tile map and at least partially inside clip rect */
+  const amount_t tx0 = std::max({ 0, -cx, floorDiv<coord_t>(state.clipX0 - x, gfx::SPRITE_WIDTH) });
+  const amount_t tx1 = std::min({ cw, coord_t(gfx::TILE_MAP_WIDTH) - cx, floorDiv<coord_t>(state.clipX1 - x + gfx::SPRITE_WIDTH - 1, gfx::SPRITE_WIDTH) });
+  const amount_t ty0 = std::max({ 0, -cy, floorDiv<coord_t>(state.clipY0 - y, gfx::SPRITE_HEIGHT) });
+  const amount_t ty1 = std::min({ ch, coord_t(gfx::TILE_MAP_HEIGHT) - cy, floorDiv<coord_t>(state.clipY1 - y + gfx::SPRITE_HEIGHT - 1, gfx::SPRITE_HEIGHT) });
+
+  const sprite_flags_t* flags = _memory.spriteFlagsFor(0);
+
+  for (amount_t ty = ty0; ty < ty1; ++ty)
+  {
+    const sprite_index_t* row = _memory.spriteInTileMap(0, cy + ty);
+
+    for (amount_t tx = tx0; tx < tx1; ++tx)
+    {
+      const sprite_index_t index = row[cx + tx];
+
+      /* don't draw if index is 0 or layer is not zero and sprite flags are not correcly masked to it */
+      /* TODO: experimentally the behavior is layer & flags != 0 instead that layer & flags == layer */
+      if (index != 0 && (!layer || (layer & flags[index]) != 0))
+        blitCell<false, false>(state, index, x + tx * gfx::SPRITE_WIDTH, y + ty * gfx::SPRITE_HEIGHT);
     }
   }
 }
 
-void Machine::pal(color_t c0, color_t c1, palette_index_t index)
+void Machine::tline(coord_t x0, coord_t y0, coord_t x1, coord_t y1, fixed_t mx, fixed_t my, fixed_t mdx, fixed_t mdy, sprite_flags_t layer)
 {
-  gfx::palette_t* palette = _memory.paletteAt(index);
-  palette->set(c0, c1);
+  const auto& state = drawState();
+  const gfx::map_wrap_t* wrap = _memory.mapWrap();
+
+  /* wrap registers are not part of draw state so they're packed into the command */
+  const int32_t packedWrap = int32_t(wrap->width | (wrap->height << 8) | (wrap->x << 16) | (uint32_t(wrap->y) << 24));
+
+  submit(state, { command_t::TEXTURED_LINE, 0, { x0 - state.cameraX, y0 - state.cameraY, x1 - state.cameraX, y1 - state.cameraY, mx, my, mdx, mdy, layer, packedWrap } });
 }
 
+void Machine::drawTexturedLine(const gfx::DrawState& state, coord_t x0, coord_t y0, coord_t x1, coord_t y1, fixed_t mx, fixed_t my, fixed_t mdx, fixed_t mdy, sprite_flags_t layer, const gfx::map_wrap_t& wrap)
+{
+  const auto& sheet = spriteSheet();
+  const sprite_flags_t* flags = _memory.spriteFlagsFor(0);
 
-void Machine::map(coord_t cx, coord_t cy, coord_t x, coord_t y, amount_t cw, amount_t ch, sprite_flags_t layer)
+  /* a wrap size of 0 gives a mask with all bits set so coordinates are left as they are */
+  const fixed_t maskX = fixed_t(uint32_t(wrap.width) << 16) - 1, maskY = fixed_t(uint32_t(wrap.height) << 16) - 1;
+  const fixed_t offsetX = fixed_t(wrap.x) << 16, offsetY = fixed_t(wrap.y) << 16;
+
+  /* map coordinates are in tiles, every pixel of a sprite is 1/8 of a tile */
+  auto sample = [&] (fixed_t u, fixed_t v, color_t* dest) {
+    u = offsetX + (u & maskX);
+    v = offsetY + (v & maskY);
+
+    const coord_t tx = u >> 16, ty = v >> 16;
+
+    if (tx >= 0 && tx < coord_t(gfx::TILE_MAP_WIDTH) && ty >= 0 && ty < coord_t(gfx::TILE_MAP_HEIGHT))
+    {
+      const sprite_index_t index = *_memory.spriteInTileMap(tx, ty);
+
+      if (index != 0 && (!layer || (layer & flags[index])))
+      {
+        const coord_t sx = (index % gfx::SPRITES_PER_SPRITE_SHEET_ROW) * gfx::SPRITE_WIDTH + ((u >> 13) & 7);
+        const coord_t sy = (index / gfx::SPRITES_PER_SPRITE_SHEET_ROW) * gfx::SPRITE_HEIGHT + ((v >> 13) & 7);
+        const color_t c = *sheet.row(sx, sy);
+
+        if (!state.isTransparent(c))
+          *dest = state.color(c);
+      }
+    }
+  };
+
+  const coord_t dx = x1 - x0, dy = y1 - y0;
+  const coord_t stepX = dx < 0 ? -1 : 1, stepY = dy < 0 ? -1 : 1;
+
+  /* horizontal and vertical lines, used by floor and wall renderers, only step over the part inside clip rect */
+  if (dx == 0 || dy == 0)
+  {
+    const bool horizontal = dy == 0;
+    const coord_t start = horizontal ? x0 : y0, step = horizontal ? stepX : stepY, length = std::abs(horizontal ? dx : dy) + 1;
+    const coord_t fixed = horizontal ? y0 : x0;
+    const coord_t clip0 = horizontal ? state.clipX0 : state.clipY0, clip1 = horizontal ? state.clipX1 : state.clipY1;
+
+    if (fixed < (horizontal ? state.clipY0 : state.clipX0) || fixed >= (horizontal ? state.clipY1 : state.clipX1))
+      return;
+
+    /* pixels i in [i0, i1) are the ones with start + i*step inside [clip0, clip1) */
+    const coord_t i0 = std::max(0, step > 0 ? clip0 - start : start - clip1 + 1);
+    const coord_t i1 = std::min(length, step > 0 ? clip1 - start : start - clip0 + 1);
+
+    if (i0 >= i1)
+      return;
+
+    color_t* dest = horizontal ? _memory.screen(start + i0 * step, fixed) : _memory.screen(fixed, start + i0 * step);
+    const coord_t pitch = (horizontal ? 1 : coord_t(gfx::SCREEN_WIDTH)) * step;
+
+    mx += mdx * i0;
+    my += mdy * i0;
+
+    for (coord_t i = i0; i < i1; ++i, dest += pitch, mx += mdx, my += mdy)
+      sample(mx, my, dest);
+
+    return;
+  }
+
+  /* other lines step along major axis a, minor axis b is moved every time error goes below 0, so after i steps
+     it has moved k(i) = ceil((i * db - da / 2) / da) times, which gives the range of steps inside clip rect */
+  const coord_t adx = std::abs(dx), ady = std::abs(dy);
+  const bool xMajor = adx >= ady;
+  const int64_t da = xMajor ? adx : ady, db = xMajor ? ady : adx, half = da / 2;
+  const coord_t a0 = xMajor ? x0 : y0, b0 = xMajor ? y0 : x0;
+  const coord_t sa = xMajor ? stepX : stepY, sb = xMajor ? stepY : stepX;
+
+  const coord_t aMin = xMajor ? state.clipX0 : state.clipY0, aMax = (xMajor ? state.clipX1 : state.clipY1) - 1;
+  const coord_t bMin = xMajor ? state.clipY0 : state.clipX0, bMax = (xMajor ? state.clipY1 : state.clipX1) - 1;
+  const int64_t kMin = sb > 0 ? bMin - b0 : b0 - bMax, kMax = sb > 0 ? bMax - b0 : b0 - bMin;
+
+  int64_t i0 = std::max<int64_t>(0, sa > 0 ? aMin - a0 : a0 - aMax);
+  int64_t i1 = std::min<int64_t>(da, sa > 0 ? aMax - a0 : a0 - aMin);
+  i0 = std::max(i0, floorDiv<int64_t>((kMin - 1) * da + half, db) + 1);
+  i1 = std::min(i1, floorDiv<int64_t>(kMax * da + half, db));
+
+  if (i0 > i1)
+    return;
+
+  const int64_t k0 = ceilDiv<int64_t>(i0 * db - half, da);
+  const coord_t a = a0 + sa * coord_t(i0), b = b0 + sb * coord_t(k0);
+  coord_t x = xMajor ? a : b, y = xMajor ? b : a, error = coord_t(half - i0 * db + k0 * da);
+  const coord_t length = coord_t(i1 - i0 + 1);
+
+  mx += mdx * coord_t(i0);
+  my += mdy * coord_t(i0);
+
+  for (coord_t i = 0; i < length; ++i, mx += mdx, my += mdy)
+  {
+    sample(mx, my, _memory.screen(x, y));
+
+    if (xMajor)
+    {
+      x += stepX;
+      error -= ady;
+      if (error < 0) { y += stepY; error += adx; }
+    }
+    else
+    {
+      y += stepY;
+      error -= adx;
+      if (error < 0) { x += stepX; error += ady; }
+    }
+  }
+}
+
+void Machine::record(const gfx::DrawState& state, const gfx::DrawCommand& command, coord_t y0, coord_t y1)
 {
-  for (amount_t ty = 0; ty < ch; ++ty)
+  /* commands are binned by the bands they touch so that every worker walks only its own ones */
+  const size_t bands = _bins.size();
+  const uint32_t index = uint32_t(_commands.size());
+  bool binned = false;
+
+  for (size_t band = 0; band < bands; ++band)
   {
-    for (amount_t tx = 0; tx < cw; ++tx)
+    if (y0 < bandStart(band + 1, bands) && y1 >= bandStart(band, bands))
     {
-      const sprite_index_t index = *_memory.spriteInTileMap(cx + tx, cy + ty);
+      _bins[band].push_back(index);
+      binned = true;
+    }
+  }
 
-      /* don't draw if index is 0 or layer is not zero and sprite flags are not correcly masked to it */
-      /* TODO: experimentally the behavior is layer & flags != 0 instead that layer & flags == layer */
-      if (index != 0 && (!layer || (layer & *_memory.spriteFlagsFor(index)) != 0))
-        spr(index, x + tx * gfx::SPRITE_WIDTH, y + ty * gfx::SPRITE_HEIGHT);
+  if (!binned)
+    return;
+
+  if (_commandStates.empty() || !_commandStates.back().isValid(_memory.drawStateGeneration()))
+    _commandStates.push_back(state);
+
+  /* data is copied since it can be overwritten before commands are executed, pointers are fixed when flushing */
+  _commands.push_back({ command, uint32_t(_commandStates.size() - 1), uint32_t(_commandData.size()) });
+  if (command.data)
+    _commandData.insert(_commandData.end(), command.data, command.data + command.length);
+
+  _memory.markDrawsPending();
+}
+
+/* conservative range [y0, y1] of rows touched by a command, empty if y0 > y1, it's found when
+   submitted so that rows can be marked dirty and commands binned before flushing */
+std::pair<coord_t, coord_t> Machine::rowRange(const gfx::DrawState& state, const gfx::DrawCommand& command)
+{
+  const auto& a = command.args;
+  coord_t y0 = 0, y1 = -1;
+
+  switch (command.type)
+  {
+    case command_t::PIXEL: y0 = y1 = a[1]; break;
+    case command_t::PIXELS:
+      y0 = y1 = command.data[1];
+      for (uint32_t i = 3; i < command.length; i += 3)
+      {
+        y0 = std::min(y0, command.data[i + 1]);
+        y1 = std::max(y1, command.data[i + 1]);
+      }
+      break;
+    case command_t::FILL_SPAN: y0 = y1 = a[2]; break;
+    case command_t::FILL_RECT: y0 = a[1]; y1 = a[3]; break;
+    case command_t::FILL_COLUMN: y0 = a[1]; y1 = a[2]; break;
+    case command_t::LINE:
+    case command_t::TEXTURED_LINE:
+      y0 = std::min(a[1], a[3]); y1 = std::max(a[1], a[3]); break;
+    case command_t::FILL_SYMMETRIC:
+    case command_t::STROKE_SYMMETRIC:
+      y0 = a[1] - coord_t(command.length) + 1; y1 = a[3] + coord_t(command.length) - 1; break;
+    case command_t::FILL_TRIANGLE:
+      y0 = std::min({ a[1], a[3], a[5] }); y1 = std::max({ a[1], a[3], a[5] }); break;
+    case command_t::FILL_MASK: y0 = a[1]; y1 = a[1] + command.mask->height - 1; break;
+    case command_t::BLIT_SPRITE: y0 = a[3]; y1 = a[3] + a[5] - 1; break;
+    case command_t::BLIT_SPRITES:
+      y0 = command.data[3]; y1 = command.data[3] + command.data[5] - 1;
+      for (uint32_t i = 6; i < command.length; i += 6)
+      {
+        y0 = std::min(y0, command.data[i + 3]);
+        y1 = std::max(y1, command.data[i + 3] + command.data[i + 5] - 1);
+      }
+      break;
+    case command_t::STRETCH_SPRITE: y0 = a[5]; y1 = a[5] + a[7] - 1; break;
+  }
+
+  return std::make_pair(std::max(y0, state.clipY0), std::min(y1, state.clipY1 - 1));
+}
+
+void Machine::execute(const gfx::DrawState& state, const gfx::DrawCommand& command)
+{
+  const auto& a = command.args;
+  const bool flipX = (command.flags & command_t::FLIP_X) != 0, flipY = (command.flags & command_t::FLIP_Y) != 0;
+
+  switch (command.type)
+  {
+    case command_t::PIXEL:
+      if (state.contains(a[0], a[1]))
+        plot(_memory.screen(a[0], a[1]), a[0], a[1], command.fill);
+      break;
+    case command_t::PIXELS:
+      /* batched pixels are (x, y, color) */
+      for (uint32_t i = 0; i < command.length; i += 3)
+      {
+        const coord_t x = command.data[i], y = command.data[i + 1];
+        if (state.contains(x, y))
+          plot(_memory.screen(x, y), x, y, state.fill(color_t(command.data[i + 2])));
+      }
+      break;
+    case command_t::FILL_SPAN: clipAndFillSpan(state, a[0], a[1], a[2], command.fill); break;
+    case command_t::FILL_RECT: clipAndFillRect(state, a[0], a[1], a[2], a[3], command.fill); break;
+    case command_t::FILL_COLUMN: clipAndFillColumn(state, a[0], a[1], a[2], command.fill); break;
+    case command_t::LINE: clipAndDrawLine(state, a[0], a[1], a[2], a[3], command.fill); break;
+    case command_t::FILL_SYMMETRIC: fillSymmetricSpans(state, a[0], a[1], a[2], a[3], command.data, command.length, command.fill); break;
+    case command_t::STROKE_SYMMETRIC: strokeSymmetricSpans(state, a[0], a[1], a[2], a[3], command.data, command.length, command.fill); break;
+    case command_t::FILL_TRIANGLE: fillTriangle(state, a[0], a[1], a[2], a[3], a[4], a[5], command.fill); break;
+    case command_t::FILL_MASK: fillMask(state, a[0], a[1], *command.mask, command.fill); break;
+    case command_t::BLIT_SPRITE:
+      if (flipX && flipY) blitSprite<true, true>(state, a[0], a[1], a[2], a[3], a[4], a[5]);
+      else if (flipX) blitSprite<true, false>(state, a[0], a[1], a[2], a[3], a[4], a[5]);
+      else if (flipY) blitSprite<false, true>(state, a[0], a[1], a[2], a[3], a[4], a[5]);
+      else blitSprite<false, false>(state, a[0], a[1], a[2], a[3], a[4], a[5]);
+      break;
+    case command_t::BLIT_SPRITES:
+      /* batched sprites are blit arguments (sx, sy, x, y, w, h) */
+      for (uint32_t i = 0; i < command.length; i += 6)
+      {
+        const coord_t* b = command.data + i;
+        blitSprite<false, false>(state, b[0], b[1], b[2], b[3], b[4], b[5]);
+      }
+      break;
+    case command_t::STRETCH_SPRITE:
+      if (flipX && flipY) stretchSprite<true, true>(state, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+      else if (flipX) stretchSprite<true, false>(state, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+      else if (flipY) stretchSprite<false, true>(state, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+      else stretchSprite<false, false>(state, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+      break;
+    case command_t::TEXTURED_LINE:
+    {
+      const gfx::map_wrap_t wrap = { uint8_t(a[9]), uint8_t(a[9] >> 8), uint8_t(a[9] >> 16), uint8_t(a[9] >> 24) };
+      drawTexturedLine(state, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], sprite_flags_t(a[8]), wrap);
+      break;
+    }
+  }
+}
+
+void Machine::flush()
+{
+  if (_commands.empty())
+    return;
+
+  /* workers can't update anything lazily so sprite sheet and byte per pixel screen are brought up to date here */
+  spriteSheet();
+  _memory.screen(0, 0);
+
+  for (auto& recorded : _commands)
+  {
+    if (recorded.command.data)
+      recorded.command.data = _commandData.data() + recorded.offset;
+  }
+
+  /* every worker replays commands of its bin in recorded order clipped to its band so each pixel is written in the same order as immediately */
+  const size_t bands = _bins.size();
+
+  _workers.run([this, bands] (size_t band) {
+    const coord_t y0 = bandStart(band, bands), y1 = bandStart(band + 1, bands);
+
+    std::vector<gfx::DrawState> states(_commandStates);
+    for (auto& state : states)
+    {
+      state.clipY0 = std::max(state.clipY0, y0);
+      state.clipY1 = std::min(state.clipY1, y1);
     }
+
+    for (uint32_t index : _bins[band])
+      execute(states[_commands[index].state], _commands[index].command);
+  });
+
+  _commands.clear();
+  _commandStates.clear();
+  _commandData.clear();
+  for (auto& bin : _bins)
+    bin.clear();
+}
+
+void WorkerPool::resize(size_t count)
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _quit = true;
+  }
+
+  _wake.notify_all();
+
+  for (auto& thread : _threads)
+    thread.join();
+
+  _threads.clear();
+  _quit = false;
+
+  for (size_t i = 1; i < count; ++i)
+    _threads.emplace_back(&WorkerPool::loop, this, i, _round);
+}
+
+void WorkerPool::loop(size_t index, uint32_t round)
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  for (;;)
+  {
+    _wake.wait(lock, [this, round] () { return _quit || _round != round; });
+
+    if (_quit)
+      return;
+
+    round = _round;
+
+    lock.unlock();
+    _job(index);
+    lock.lock();
+
+    if (--_running == 0)
+      _done.notify_one();
+  }
+}
+
+void WorkerPool::run(const std::function<void(size_t)>& job)
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _job = job;
+    _running = _threads.size();
+    ++_round;
   }
+
+  _wake.notify_all();
+
+  job(0);
+
+  std::unique_lock<std::mutex> lock(_mutex);
+  _done.wait(lock, [this] () { return _running == 0; });
 }
@@ -7,8 +7,14 @@
 #include "lua_bridge.h"
 #include "memory.h"
 
+#include <algorithm>
 #include <array>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 #include <random>
+#include <thread>
+#include <vector>
 
 namespace retro8
 {
@@ -21,6 +27,29 @@ namespace retro8
     std::array<bit_mask<button_t>, PLAYER_COUNT> previousButtons;
   };
 
+  /* threads which run a job together with the calling thread, each one with its own index, until all of them are done */
+  class WorkerPool
+  {
+  private:
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _wake, _done;
+    std::function<void(size_t)> _job;
+    uint32_t _round;
+    size_t _running;
+    bool _quit;
+
+    void loop(size_t index, uint32_t round);
+
+  public:
+    WorkerPool() : _round(0), _running(0), _quit(false) { }
+    ~WorkerPool() { resize(1); }
+
+    size_t size() const { return _threads.size() + 1; }
+    void resize(size_t count);
+    void run(const std::function<void(size_t)>& job);
+  };
+
   class Machine
   {
   private:
@@ -28,26 +57,120 @@ namespace retro8
     Memory _memory;
     sfx::APU _sound;
     gfx::Font _font;
+    gfx::SpriteSheetCache _spriteSheet;
+    gfx::CircleSpanCache _circles;
+    gfx::DrawState _drawState;
+    gfx::TextRunCache _textRuns;
+    gfx::MapLayerCache _mapLayers;
+    bool _mapCache;
     lua::Code _code;
 
+    /* commands recorded while drawing is deferred, together with the draw state they were issued with
+       and the offset of their data, they're rasterized by workers each owning a band of screen rows */
+    struct recorded_command_t
+    {
+      gfx::DrawCommand command;
+      uint32_t state;
+      uint32_t offset;
+    };
+
+    std::vector<recorded_command_t> _commands;
+    std::vector<gfx::DrawState> _commandStates;
+    std::vector<coord_t> _commandData;
+
+    /* entries of batched calls as read from scripts and as resolved into a single command */
+    std::vector<coord_t> _batchEntries;
+    std::vector<coord_t> _batchCommand;
+    /* indices of the commands touching each band */
+    std::vector<std::vector<uint32_t>> _bins;
+    WorkerPool _workers;
+
   private:
-    void circHelper(coord_t xc, coord_t yc, coord_t x, coord_t y, color_t col);
-    void circFillHelper(coord_t xc, coord_t yc, coord_t x, coord_t y, color_t col);
+    gfx::SpriteSheetCache& spriteSheet()
+    {
+      if (!_spriteSheet.isValid(_memory.spriteSheetGeneration()))
+        _spriteSheet.update(_memory.spriteSheet(), _memory.spriteSheetGeneration());
+      return _spriteSheet;
+    }
+
+    const gfx::DrawState& drawState()
+    {
+      if (!_drawState.isValid(_memory.drawStateGeneration()))
+        _drawState.update(_memory.paletteAt(gfx::DRAW_PALETTE_INDEX), _memory.clipRect(), _memory.camera(), _memory.fillPattern(), _memory.drawStateGeneration());
+      return _drawState;
+    }
+
+    /* span engine: coordinates are in screen space, inclusive and colors are already remapped */
+    void fillSpan(coord_t x0, coord_t x1, coord_t y, color_t color);
+    void fillSpan(coord_t x0, coord_t x1, coord_t y, const gfx::fill_t& fill);
+    void clipAndFillSpan(const gfx::DrawState& state, coord_t x0, coord_t x1, coord_t y, const gfx::fill_t& fill);
+    void clipAndFillRect(const gfx::DrawState& state, coord_t x0, coord_t y0, coord_t x1, coord_t y1, const gfx::fill_t& fill);
+    void clipAndFillColumn(const gfx::DrawState& state, coord_t x, coord_t y0, coord_t y1, const gfx::fill_t& fill);
+    void fillMask(const gfx::DrawState& state, coord_t x, coord_t y, const gfx::text_mask_t& mask, const gfx::fill_t& fill);
+    void clipAndDrawLine(const gfx::DrawState& state, coord_t x0, coord_t y0, coord_t x1, coord_t y1, const gfx::fill_t& fill);
+
+    /* sprite blitters: source is in sprite sheet pixels, destination is in screen space */
+    template<bool FLIP_X, bool FLIP_Y> void blitSprite(const gfx::DrawState& state, coord_t sx, coord_t sy, coord_t x, coord_t y, coord_t w, coord_t h);
+    template<bool FLIP_X, bool FLIP_Y> void blitCell(const gfx::DrawState& state, sprite_index_t index, coord_t x, coord_t y);
+    template<bool FLIP_X, bool FLIP_Y> void stretchSprite(const gfx::DrawState& state, coord_t sx, coord_t sy, coord_t sw, coord_t sh, coord_t x, coord_t y, coord_t w, coord_t h);
+
+    void refreshMapLayer(const gfx::DrawState& state, gfx::MapLayerCache::layer_t& layer);
+    void fillTriangle(const gfx::DrawState& state, coord_t x0, coord_t y0, coord_t x1, coord_t y1, coord_t x2, coord_t y2, const gfx::fill_t& fill);
+    void drawTexturedLine(const gfx::DrawState& state, coord_t x0, coord_t y0, coord_t x1, coord_t y1, fixed_t mx, fixed_t my, fixed_t mdx, fixed_t mdy, sprite_flags_t layer, const gfx::map_wrap_t& wrap);
+
+    /* primitives resolve their draw state and submit commands which are executed or recorded */
+    bool deferred() const { return _workers.size() > 1; }
+    static coord_t bandStart(size_t band, size_t bands) { return coord_t(band * gfx::SCREEN_HEIGHT / bands); }
+    void record(const gfx::DrawState& state, const gfx::DrawCommand& command, coord_t y0, coord_t y1);
+    void execute(const gfx::DrawState& state, const gfx::DrawCommand& command);
+    std::pair<coord_t, coord_t> rowRange(const gfx::DrawState& state, const gfx::DrawCommand& command);
+    void submit(const gfx::DrawState& state, const gfx::DrawCommand& command)
+    {
+      const auto rows = rowRange(state, command);
+      _memory.markRowsDirty(rows.first, rows.second);
+      if (deferred())
+        record(state, command, rows.first, rows.second);
+      else
+        execute(state, command);
+    }
+
+    /* shapes made by a center box (x0,y0)-(x1,y1) extended on every row by the half width of
+       that row distance from the box, eg. a circle is a single point box with a circle table */
+    void fillSymmetricSpans(const gfx::DrawState& state, coord_t x0, coord_t y0, coord_t x1, coord_t y1, const coord_t* halfWidths, amount_t rows, const gfx::fill_t& fill);
+    void strokeSymmetricSpans(const gfx::DrawState& state, coord_t x0, coord_t y0, coord_t x1, coord_t y1, const coord_t* halfWidths, amount_t rows, const gfx::fill_t& fill);
 
 
   public:
-    Machine() : _sound(_memory)
+    Machine() : _sound(_memory), _mapCache(R8_MAP_CACHE_ENABLED)
     {
+      _memory.setDrawFlusher([this] () { flush(); });
+      setDrawThreads(R8_DRAW_THREADS);
     }
 
+    /* with more than one thread draw calls are recorded and rasterized in parallel when screen is needed */
+    void setDrawThreads(size_t count)
+    {
+      flush();
+      _workers.resize(std::max(count, size_t(1)));
+      _bins.assign(_workers.size(), std::vector<uint32_t>());
+    }
+    size_t drawThreads() const { return _workers.size(); }
+    void flush();
+
+    /* large map regions drawn again and again are pre-rendered, see R8_MAP_CACHE_ENABLED */
+    void setMapCache(bool enabled) { _mapCache = enabled; if (!enabled) _mapLayers.clear(); }
+    bool isMapCacheEnabled() const { return _mapCache; }
+
     Machine(const Machine&) = delete;
     Machine& operator=(const Machine&) = delete;
 
     void color(color_t color);
+    void fillp(uint16_t pattern, bool transparent);
 
     void cls(color_t color);
 
     void pset(coord_t x, coord_t y, color_t color);
+    void psetbatch(const coord_t* entries, size_t count);
     color_t pget(coord_t x, coord_t y);
 
     void line(coord_t x0, coord_t y0, coord_t x1, coord_t y1, color_t color);
@@ -55,11 +178,18 @@ namespace retro8
     void rectfill(coord_t x0, coord_t y0, coord_t x1, coord_t y1, color_t color);
     void circ(coord_t x, coord_t y, amount_t r, color_t color);
     void circfill(coord_t x, coord_t y, amount_t r, color_t color);
+    void oval(coord_t x0, coord_t y0, coord_t x1, coord_t y1, color_t color);
+    void ovalfill(coord_t x0, coord_t y0, coord_t x1, coord_t y1, color_t color);
+    void rrect(coord_t x, coord_t y, amount_t w, amount_t h, amount_t r, color_t color);
+    void rrectfill(coord_t x, coord_t y, amount_t w, amount_t h, amount_t r, color_t color);
+    void trifill(coord_t x0, coord_t y0, coord_t x1, coord_t y1, coord_t x2, coord_t y2, color_t color);
 
     void pal(color_t c0, color_t c1, palette_index_t index);
 
     void map(coord_t cx, coord_t cy, coord_t x, coord_t y, amount_t cw, amount_t ch, sprite_flags_t layer);
+    void tline(coord_t x0, coord_t y0, coord_t x1, coord_t y1, fixed_t mx, fixed_t my, fixed_t mdx, fixed_t mdy, sprite_flags_t layer);
     void spr(index_t idx, coord_t x, coord_t y);
+    void sprbatch(const coord_t* entries, size_t count);
     void spr(index_t idx, coord_t x, coord_t y, float w, float h, bool flipX, bool flipY);
     void sspr(coord_t sx, coord_t sy, coord_t sw, coord_t sh, coord_t dx, coord_t dy, coord_t dw, coord_t dh, bool flipX, bool flipY);
 
@@ -68,6 +198,8 @@ namespace retro8
     State& state() { return _state; }
     Memory& memory() { return _memory; }
     gfx::Font& font() { return _font; }
+    const gfx::TextRunCache& textRuns() const { return _textRuns; }
+    std::vector<coord_t>& batchEntries() { return _batchEntries; }
     lua::Code& code() { return _code; }
     sfx::APU& sound() { return _sound; }
   };
@@ -7,6 +7,8 @@
 #include "lua_bridge.h"
 
 #include <array>
+#include <bitset>
+#include <functional>
 #include <random>
 #include <cstring>
 
@@ -16,6 +18,7 @@ namespace retro8
   {
     static constexpr address_t SPRITE_SHEET = 0x0000;
     static constexpr address_t SPRITE_FLAGS = 0x3000;
+    static constexpr address_t SPRITE_FLAGS_END = 0x3100;
 
     static constexpr address_t MUSIC = 0x3100;
     static constexpr address_t SOUNDS = 0x3200;
@@ -26,8 +29,15 @@ namespace retro8
     static constexpr address_t PEN_COLOR = 0x5f25;
     static constexpr address_t CURSOR = 0x5f26;
     static constexpr address_t CAMERA = 0x5f28;
+    static constexpr address_t FILL_PATTERN = 0x5f31;
+    static constexpr address_t MAP_WRAP = 0x5f38;
 
     static constexpr address_t SCREEN_DATA = 0x6000;
+    static constexpr address_t SCREEN_DATA_END = 0x8000;
+
+    static constexpr address_t SPRITE_SHEET_END = 0x2000;
+    static constexpr address_t DRAW_STATE = 0x5f00;
+    static constexpr address_t DRAW_STATE_END = 0x5f34;
 
     static constexpr address_t TILE_MAP_LOW = 0x1000;
     static constexpr address_t TILE_MAP_HIGH = 0x2000;
@@ -46,21 +56,116 @@ namespace retro8
 
     static constexpr size_t ROWS_PER_TILE_MAP_HALF = 32;
 
+    uint32_t _spriteSheetGeneration;
+    uint32_t _mapGeneration;
+    uint32_t _drawStateGeneration;
+
+    /* drawing happens on a byte per pixel copy of the screen which is packed into screen memory
+       only when it's accessed directly, at least one of the two is always up to date */
+    std::array<color_t, gfx::SCREEN_WIDTH * gfx::SCREEN_HEIGHT> _screen;
+    bool _screenValid, _screenDataValid;
+
+    /* rows of the screen modified since the frontend last converted them to its own format */
+    std::bitset<gfx::SCREEN_HEIGHT> _dirtyRows;
+
+    /* draw commands recorded but not rasterized yet must be flushed before memory is accessed directly */
+    std::function<void()> _drawFlusher;
+    bool _drawsPending;
+
+    static bool overlapsScreen(address_t address, int32_t length) { return address < address::SCREEN_DATA_END && address + length > address::SCREEN_DATA; }
+
+    void packScreen()
+    {
+      uint8_t* dest = memory + address::SCREEN_DATA;
+      for (size_t i = 0; i < gfx::BYTES_PER_SCREEN; ++i)
+        dest[i] = _screen[i * 2] | (_screen[i * 2 + 1] << 4);
+      _screenDataValid = true;
+    }
+
+    void unpackScreen()
+    {
+      const uint8_t* src = memory + address::SCREEN_DATA;
+      for (size_t i = 0; i < gfx::BYTES_PER_SCREEN; ++i)
+      {
+        _screen[i * 2] = color_t(src[i] & 0x0f);
+        _screen[i * 2 + 1] = color_t(src[i] >> 4);
+      }
+      _screenValid = true;
+    }
 
   public:
-    Memory()
+    Memory() : _spriteSheetGeneration(1), _mapGeneration(1), _drawStateGeneration(1), _screenValid(true), _screenDataValid(true), _drawsPending(false)
     {
       memset(memory, 0, 1024 * 32);
+      _screen.fill(color_t::BLACK);
       paletteAt(gfx::DRAW_PALETTE_INDEX)->reset();
       paletteAt(gfx::SCREEN_PALETTE_INDEX)->reset();
       clipRect()->reset();
       cursor()->reset();
+      _dirtyRows.set();
     }
 
     void backupCartridge()
     {
       std::memcpy(_backup, memory, address::CART_DATA_LENGTH);
+      /* cartridge has just been loaded so everything must be considered modified */
+      markDirty(0, address::CART_DATA_LENGTH);
+    }
+
+    /* must be invoked before memory is read or written directly so that screen memory is up to date */
+    void sync(address_t address, int32_t length)
+    {
+      flushDraws();
+      if (!_screenDataValid && overlapsScreen(address, length))
+        packScreen();
+    }
+
+    /* must be invoked whenever memory is written directly so that derived state can be invalidated */
+    void markDirty(address_t address, int32_t length)
+    {
+      if (overlapsScreen(address, length))
+      {
+        _screenValid = false;
+        const address_t first = std::max(address, address::SCREEN_DATA) - address::SCREEN_DATA;
+        const address_t last = std::min<int32_t>(address + length, address::SCREEN_DATA_END) - 1 - address::SCREEN_DATA;
+        markRowsDirty(first / gfx::SCREEN_PITCH, last / gfx::SCREEN_PITCH);
+      }
+      /* every converted pixel depends on screen palette */
+      const address_t screenPalette = address::PALETTES + gfx::SCREEN_PALETTE_INDEX * BYTES_PER_PALETTE;
+      if (address < screenPalette + address_t(BYTES_PER_PALETTE) && address + length > screenPalette)
+        _dirtyRows.set();
+      if (address < address::SPRITE_SHEET_END && address + length > address::SPRITE_SHEET)
+        ++_spriteSheetGeneration;
+      /* tile map and sprite flags decide which sprites map() draws */
+      if (address < address::SPRITE_FLAGS_END && address + length > address::TILE_MAP_LOW)
+        ++_mapGeneration;
+      if (address < address::DRAW_STATE_END && address + length > address::DRAW_STATE)
+        ++_drawStateGeneration;
+    }
+
+    void setDrawFlusher(const std::function<void()>& flusher) { _drawFlusher = flusher; }
+    void markDrawsPending() { _drawsPending = true; }
+    void flushDraws()
+    {
+      if (_drawsPending)
+      {
+        _drawsPending = false;
+        _drawFlusher();
+      }
+    }
+
+    void markRowsDirty(coord_t y0, coord_t y1)
+    {
+      for (coord_t y = std::max(y0, 0); y <= std::min(y1, coord_t(gfx::SCREEN_HEIGHT - 1)); ++y)
+        _dirtyRows.set(y);
     }
+    bool isRowDirty(coord_t y) const { return _dirtyRows.test(y); }
+    bool hasDirtyRows() const { return _dirtyRows.any(); }
+    void clearDirtyRows() { _dirtyRows.reset(); }
+
+    uint32_t spriteSheetGeneration() const { return _spriteSheetGeneration; }
+    uint32_t mapGeneration() const { return _mapGeneration; }
+    uint32_t drawStateGeneration() const { return _drawStateGeneration; }
 
     const uint8_t* backup() const { return _backup; }
     uint8_t* base() { return memory; }
@@ -69,11 +174,28 @@ namespace retro8
     gfx::cursor_t* cursor() { return as<gfx::cursor_t>(address::CURSOR); }
     gfx::camera_t* camera() { return as<gfx::camera_t>(address::CAMERA); }
     gfx::clip_rect_t* clipRect() { return as<gfx::clip_rect_t>(address::CLIP_RECT); }
+    gfx::fill_pattern_t* fillPattern() { return as<gfx::fill_pattern_t>(address::FILL_PATTERN); }
+    gfx::map_wrap_t* mapWrap() { return as<gfx::map_wrap_t>(address::MAP_WRAP); }
 
     gfx::color_byte_t* spriteSheet(coord_t x, coord_t y) { return spriteSheet() + x / gfx::PIXEL_TO_BYTE_RATIO + y * gfx::SPRITE_SHEET_PITCH; }
     gfx::color_byte_t* spriteSheet() { return as<gfx::color_byte_t>(address::SPRITE_SHEET); }
-    gfx::color_byte_t* screenData() { return as<gfx::color_byte_t>(address::SCREEN_DATA); }
-    gfx::color_byte_t* screenData(coord_t x, coord_t y) { return screenData() + y * gfx::SCREEN_PITCH + x / gfx::PIXEL_TO_BYTE_RATIO; }
+    gfx::color_byte_t* screenData() { sync(address::SCREEN_DATA, gfx::BYTES_PER_SCREEN); return as<gfx::color_byte_t>(address::SCREEN_DATA); }
+
+    /* byte per pixel screen, drawing through it leaves screen memory out of date until next sync */
+    color_t* screen(coord_t x, coord_t y)
+    {
+      if (!_screenValid) unpackScreen();
+      /* only written when needed since rasterizer threads call this concurrently */
+      if (_screenDataValid) _screenDataValid = false;
+      return _screen.data() + y * gfx::SCREEN_WIDTH + x;
+    }
+
+    const color_t* screenPixels()
+    {
+      flushDraws();
+      if (!_screenValid) unpackScreen();
+      return _screen.data();
+    }
     integral_t* cartData(index_t idx) { return as<integral_t>(address::CART_DATA + idx * sizeof(integral_t)); } //TODO: ENDIANNESS!!
 
     sfx::Sound* sound(sfx::sound_index_t i) { return as<sfx::Sound>(address::SOUNDS + sizeof(sfx::Sound)*i); }